@@ -58,9 +58,22 @@
 #define ALIGNMENT 8  
 
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes, unless changed at runtime 
  */
-#define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#define MAX_HEAP (20*((size_t)1<<20))  /* 20 MB */
+
+/* 
+ * Address space reserved for each heap in bytes. Its pages are only 
+ * committed as the heap grows into them. The heap size can be raised 
+ * up to it at runtime 
+ */
+#define MAX_RESERVE (16*((size_t)1<<30))  /* 16 GB */
+
+/*
+ * Size of a transparent huge page. Regions set up for huge pages are
+ * aligned to it, and committed a huge page at a time
+ */
+#define HUGE_PAGE (2*((size_t)1<<20))  /* 2 MB */
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -15,6 +15,10 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <sys/resource.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -30,8 +34,15 @@
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* Command line options. -T is only there when mm.c is thread-safe */
+#ifdef MM_THREADS
+#define OPTSTRING "f:t:hvVgalPFH:T:"
+#else
+#define OPTSTRING "f:t:hvVgalPFH:"
+#endif
+
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((size_t)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
@@ -46,14 +57,15 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    enum {ALLOC, FREE, REALLOC, MEMALIGN, CALLOC} type; /* type of request */
     int index;                        /* index for free() to use later */
     int size;                         /* byte size of alloc/realloc request */
+    int align;                        /* alignment of memalign request */
 } traceop_t;
 
 /* Holds the information for one trace file*/
 typedef struct {
-    int sugg_heapsize;   /* suggested heap size (unused) */
+    size_t sugg_heapsize; /* suggested heap size, raising the heap limit */
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
@@ -78,9 +90,15 @@ typedef struct {
     double ops;      /* number of ops (malloc/free/realloc) in the trace */
     int valid;       /* was the trace processed correctly by the allocator? */
     double secs;     /* number of secs needed to run the trace */
+    double faults;   /* minor page faults taken by a timed run of the trace */
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    size_t rss;      /* resident bytes of the heap after the trace (-P) */
+    size_t huge_rss; /* how many of those are in transparent huge pages (-P) */
+#ifdef MM_THREADS
+    double mt_secs;  /* secs needed for num_threads threads to each run the trace */
+#endif
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -92,6 +110,14 @@ int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 char msg[MAXLINE*2];      /* for whenever we need to compose an error message */
 
+static size_t heap_limit = MAX_HEAP; /* largest heap of a trace (-H) */
+static int hugepages = 0; /* back the heap by transparent huge pages (-P) */
+static int prefault = 0; /* fault the heap in before the timed runs (-F) */
+static int speed_runs = 0; /* runs timed by the last call of fsecs_faults */
+#ifdef MM_THREADS
+static int num_threads = 0; /* threads replaying each trace at once (-T) */
+#endif
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -124,9 +150,21 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void mm_replay(trace_t *trace, char **blocks);
+#ifdef MM_THREADS
+static void eval_mm_speed_mt(void *ptr);
+static void *mm_replay_thread(void *ptr);
+#endif
 
 /* Various helper routines */
+static double fsecs_faults(fsecs_test_funct f, void *argp, double *faults);
 static void printresults(int n, stats_t *stats);
+static void printhugeresults(int n, stats_t *stats);
+static void heap_pages(size_t *rss, size_t *huge_rss);
+#ifdef MM_THREADS
+static void printmtresults(int n, stats_t *stats);
+#endif
+static size_t parse_size(char *s);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -158,7 +196,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, OPTSTRING)) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -190,6 +228,26 @@ int main(int argc, char **argv)
         case 'V': /* Be more verbose than -v */
             verbose = 2;
             break;
+        case 'H': /* Let the heap grow to this many bytes */
+            if ((heap_limit = parse_size(optarg)) == 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'P': /* Back the heap by transparent huge pages */
+            hugepages = 1;
+            break;
+        case 'F': /* Fault the heap in before the timed runs */
+            prefault = 1;
+            break;
+#ifdef MM_THREADS
+        case 'T': /* Also replay each trace in this many threads at once */
+            if ((num_threads = atoi(optarg)) < 1) {
+		usage();
+		exit(1);
+	    }
+            break;
+#endif
         case 'h': /* Print this message */
 	    usage();
             exit(0);
@@ -261,7 +319,8 @@ int main(int argc, char **argv)
 		speed_params.trace = trace;
 		if (verbose > 1)
 		    printf("and performance.\n");
-		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+		libc_stats[i].secs = fsecs_faults(eval_libc_speed, &speed_params,
+						  &libc_stats[i].faults);
 	    }
 	    free_trace(trace);
 	}
@@ -285,12 +344,16 @@ int main(int argc, char **argv)
 	unix_error("mm_stats calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
+    mem_set_hugepages(hugepages);
+    mem_set_prefault(prefault);
     mem_init(); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
 	trace = read_trace(tracedir, tracefiles[i]);
 	mm_stats[i].ops = trace->num_ops;
+	mem_set_max_heap(trace->sugg_heapsize > heap_limit ? 
+			 trace->sugg_heapsize : heap_limit);
 	if (verbose > 1)
 	    printf("Checking mm_malloc for correctness, ");
 	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
@@ -302,7 +365,14 @@ int main(int argc, char **argv)
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    mm_stats[i].secs = fsecs_faults(eval_mm_speed, &speed_params,
+					    &mm_stats[i].faults);
+	    if (hugepages)
+		heap_pages(&mm_stats[i].rss, &mm_stats[i].huge_rss);
+#ifdef MM_THREADS
+	    if (num_threads > 0)
+		mm_stats[i].mt_secs = fsecs(eval_mm_speed_mt, &speed_params);
+#endif
 	}
 	free_trace(trace);
     }
@@ -313,6 +383,18 @@ int main(int argc, char **argv)
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
     }
+    if (hugepages) {
+	printf("Huge page coverage of the mm heap:\n");
+	printhugeresults(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+#ifdef MM_THREADS
+    if (num_threads > 0) {
+	printf("Results for mm malloc with %d threads:\n", num_threads);
+	printmtresults(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+#endif
 
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
@@ -395,9 +477,10 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or a mapping */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_map_contains(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -477,7 +560,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, align;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -495,7 +578,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
+    fscanf(tracefile, "%zu", &(trace->sugg_heapsize));
     fscanf(tracefile, "%d", &(trace->num_ids));     
     fscanf(tracefile, "%d", &(trace->num_ops));     
     fscanf(tracefile, "%d", &(trace->weight));        /* not used */
@@ -534,6 +617,25 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
+	case 'c':
+	    fscanf(tracefile, "%u %u", &index, &size);
+	    trace->ops[op_index].type = CALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'm':
+	    fscanf(tracefile, "%u %u %u", &index, &align, &size);
+	    if (align < ALIGNMENT || (align & (align - 1)) != 0) {
+		printf("Bogus alignment (%u) in tracefile %s\n", align, path);
+		exit(1);
+	    }
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].align = align;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
@@ -629,6 +731,52 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    trace->block_sizes[index] = size;
 	    break;
 
+        case CALLOC: /* mm_calloc */
+
+	    if ((p = mm_calloc(1, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_calloc failed.");
+		return 0;
+	    }
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		return 0;
+
+	    /* The whole payload must be zero, whatever was there before */
+	    for (j = 0; j < size; j++) {
+		if (p[j] != 0) {
+		    malloc_error(tracenum, i, "mm_calloc did not zero the payload");
+		    return 0;
+		}
+	    }
+	    memset(p, index & 0xFF, size);
+
+	    /* Remember region */
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
+        case MEMALIGN: /* mm_memalign */
+
+	    if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_memalign failed.");
+		return 0;
+	    }
+
+	    /* The payload must start at a multiple of the alignment asked for */
+	    if ((size_t)p % trace->ops[i].align != 0) {
+		sprintf(msg, "Payload address (%p) not aligned to %d bytes", 
+			p, trace->ops[i].align);
+		malloc_error(tracenum, i, msg);
+		return 0;
+	    }
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		return 0;
+	    memset(p, index & 0xFF, size);
+
+	    /* Remember region */
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
         case REALLOC: /* mm_realloc */
 	    
 	    /* Call the student's realloc */
@@ -688,11 +836,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   Utilization is the ratio hwm/footprint, where footprint is the 
+ *   largest size of the heap and the mappings together, in bytes, 
+ *   while running the student's malloc package on the trace. Mappings
+ *   are removed again, so the footprint is taken after every request.
  *   
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
@@ -702,6 +849,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    size_t footprint, max_footprint = 0;
     char *p;
     char *newp, *oldp;
 
@@ -733,6 +881,39 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 		total_size : max_total_size;
 	    break;
 
+        case CALLOC: /* mm_calloc */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+
+	    if ((p = mm_calloc(1, size)) == NULL) 
+		app_error("mm_calloc failed in eval_mm_util");
+
+	    /* Remember region and size */
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+
+	    total_size += size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+        case MEMALIGN: /* mm_memalign */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+
+	    if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) 
+		app_error("mm_memalign failed in eval_mm_util");
+	    
+	    /* Remember region and size */
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+
+	    /* The padding for the alignment counts against the package */
+	    total_size += size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
 	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
@@ -772,9 +953,13 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+
+	footprint = mem_heapsize() + mem_mapsize();
+	max_footprint = (footprint > max_footprint) ? 
+	    footprint : max_footprint;
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)max_footprint);
 }
 
 
@@ -784,15 +969,27 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
+    speed_runs++;
+
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
     if (mm_init() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
 
+    mm_replay(trace, trace->blocks);
+}
+
+/*
+ * mm_replay - Run the requests of a trace through the mm malloc
+ *    package, keeping the blocks in the given array.
+ */
+static void mm_replay(trace_t *trace, char **blocks)
+{
+    int i, index, size, newsize;
+    char *p, *newp, *oldp, *block;
+
     /* Interpret each trace request */
     for (i = 0;  i < trace->num_ops;  i++)
         switch (trace->ops[i].type) {
@@ -802,21 +999,37 @@ static void eval_mm_speed(void *ptr)
             size = trace->ops[i].size;
             if ((p = mm_malloc(size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
+            blocks[index] = p;
+            break;
+
+        case CALLOC: /* mm_calloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_calloc(1, size)) == NULL)
+		app_error("mm_calloc error in eval_mm_speed");
+            blocks[index] = p;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+		app_error("mm_memalign error in eval_mm_speed");
+            blocks[index] = p;
             break;
 
 	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
             newsize = trace->ops[i].size;
-	    oldp = trace->blocks[index];
+	    oldp = blocks[index];
             if ((newp = mm_realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
-            trace->blocks[index] = newp;
+            blocks[index] = newp;
             break;
 
         case FREE: /* mm_free */
             index = trace->ops[i].index;
-            block = trace->blocks[index];
+            block = blocks[index];
             mm_free(block);
             break;
 
@@ -825,6 +1038,47 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+#ifdef MM_THREADS
+/*
+ * eval_mm_speed_mt - This is the function that is used by fcyc()
+ *    to measure the running time of num_threads threads, each running
+ *    the whole trace through the mm malloc package at once.
+ */
+static void eval_mm_speed_mt(void *ptr)
+{
+    int i;
+    trace_t *trace = ((speed_t *)ptr)->trace;
+    pthread_t tids[num_threads];
+
+    /* Reset the heaps and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_speed_mt");
+
+    for (i = 0; i < num_threads; i++)
+	if (pthread_create(&tids[i], NULL, mm_replay_thread, trace) != 0)
+	    unix_error("pthread_create failed in eval_mm_speed_mt");
+    for (i = 0; i < num_threads; i++)
+	pthread_join(tids[i], NULL);
+}
+
+/*
+ * mm_replay_thread - Run a trace in a thread, with blocks of its own
+ */
+static void *mm_replay_thread(void *ptr)
+{
+    trace_t *trace = (trace_t *)ptr;
+    char **blocks;
+
+    if ((blocks = (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+	unix_error("calloc failed in mm_replay_thread");
+    mm_replay(trace, blocks);
+    free(blocks);
+    return NULL;
+}
+#endif
+
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -847,6 +1101,23 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    trace->blocks[trace->ops[i].index] = p;
 	    break;
 
+        case CALLOC: /* calloc */
+	    if ((p = calloc(1, trace->ops[i].size)) == NULL) {
+		malloc_error(tracenum, i, "libc calloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
+        case MEMALIGN: /* posix_memalign */
+	    if (posix_memalign((void **)&p, trace->ops[i].align, 
+			       trace->ops[i].size) != 0) {
+		malloc_error(tracenum, i, "libc posix_memalign failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[trace->ops[i].index];
@@ -881,6 +1152,8 @@ static void eval_libc_speed(void *ptr)
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
+    speed_runs++;
+
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
@@ -891,6 +1164,22 @@ static void eval_libc_speed(void *ptr)
 	    trace->blocks[index] = p;
 	    break;
 
+        case CALLOC: /* calloc */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    if ((p = calloc(1, size)) == NULL)
+		unix_error("calloc failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
+        case MEMALIGN: /* posix_memalign */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    if (posix_memalign((void **)&p, trace->ops[i].align, size) != 0)
+		unix_error("posix_memalign failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
@@ -915,6 +1204,24 @@ static void eval_libc_speed(void *ptr)
  ************************************/
 
 
+/*
+ * fsecs_faults - Time f with fsecs, and count the minor page faults
+ *     taken by an average run of it, which f counts in speed_runs
+ */
+static double fsecs_faults(fsecs_test_funct f, void *argp, double *faults)
+{
+    struct rusage before, after;
+    double secs;
+
+    speed_runs = 0;
+    getrusage(RUSAGE_SELF, &before);
+    secs = fsecs(f, argp);
+    getrusage(RUSAGE_SELF, &after);
+    *faults = speed_runs > 0 ? 
+	(double)(after.ru_minflt - before.ru_minflt) / speed_runs : 0;
+    return secs;
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
@@ -924,54 +1231,141 @@ static void printresults(int n, stats_t *stats)
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double faults = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%8s%10s%6s%9s\n", 
+	   "trace", " valid", "util", "ops", "secs", "Kops", "flt/Kop");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f%9.1f\n", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
-		   (stats[i].ops/1e3)/stats[i].secs);
+		   (stats[i].ops/1e3)/stats[i].secs,
+		   stats[i].faults/(stats[i].ops/1e3));
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
+	    faults += stats[i].faults;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%8s%10s%6s%9s\n", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
+		   "-",
 		   "-");
 	}
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	printf("%12s%5.0f%%%8.0f%10.6f%6.0f%9.1f\n", 
 	       "Total       ",
 	       (util/n)*100.0,
 	       ops, 
 	       secs,
-	       (ops/1e3)/secs);
+	       (ops/1e3)/secs,
+	       faults/(ops/1e3));
     }
     else {
-	printf("%12s%6s%8s%10s%6s\n", 
+	printf("%12s%6s%8s%10s%6s%9s\n", 
 	       "Total       ",
 	       "-", 
 	       "-", 
 	       "-", 
+	       "-",
 	       "-");
     }
 
 }
 
+/* 
+ * printhugeresults - prints how much of the resident heap of the mm
+ *     malloc package is in transparent huge pages, after each trace
+ */
+static void printhugeresults(int n, stats_t *stats) 
+{
+    int i;
+
+    printf("%5s%10s%10s%10s\n", 
+	   "trace", "rss KB", "huge KB", "coverage");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid && stats[i].rss > 0) {
+	    printf("%2d%13zu%10zu%9.0f%%\n", 
+		   i,
+		   stats[i].rss >> 10,
+		   stats[i].huge_rss >> 10,
+		   100.0 * stats[i].huge_rss / stats[i].rss);
+	}
+	else {
+	    printf("%2d%13s%10s%10s\n", i, "-", "-", "-");
+	}
+    }
+}
+
+/*
+ * heap_pages - Count the resident bytes of the mappings the heap is
+ *     in, and how many of them are in transparent huge pages, as told
+ *     by /proc/self/smaps. Both are 0 if it can't be read
+ */
+static void heap_pages(size_t *rss, size_t *huge_rss)
+{
+    FILE *fp;
+    char line[MAXLINE];
+    unsigned long lo, hi, kb;
+    int in_heap = 0;
+
+    *rss = *huge_rss = 0;
+    if ((fp = fopen("/proc/self/smaps", "r")) == NULL)
+	return;
+    while (fgets(line, MAXLINE, fp) != NULL) {
+	/* Each mapping starts with its address range, followed by its counts */
+	if (sscanf(line, "%lx-%lx", &lo, &hi) == 2)
+	    in_heap = lo <= (unsigned long)mem_heap_hi() && 
+		hi > (unsigned long)mem_heap_lo();
+	else if (in_heap && sscanf(line, "Rss: %lu kB", &kb) == 1)
+	    *rss += (size_t)kb << 10;
+	else if (in_heap && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+	    *huge_rss += (size_t)kb << 10;
+    }
+    fclose(fp);
+}
+
+#ifdef MM_THREADS
+/* 
+ * printmtresults - prints the throughput of the mm malloc package
+ *     with num_threads threads, next to the single-threaded throughput
+ */
+static void printmtresults(int n, stats_t *stats) 
+{
+    int i;
+    double mt_ops;
+
+    printf("%5s%10s%10s%8s%8s\n", 
+	   "trace", "ops", "secs", "Kops", "speedup");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid) {
+	    mt_ops = stats[i].ops * num_threads;
+	    printf("%2d%13.0f%10.6f%8.0f%7.2fx\n", 
+		   i,
+		   mt_ops,
+		   stats[i].mt_secs,
+		   (mt_ops/1e3)/stats[i].mt_secs,
+		   (mt_ops/stats[i].mt_secs)/(stats[i].ops/stats[i].secs));
+	}
+	else {
+	    printf("%2d%13s%10s%8s%8s\n", i, "-", "-", "-", "-");
+	}
+    }
+}
+#endif
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -999,19 +1393,48 @@ void malloc_error(int tracenum, int opnum, char *msg)
     printf("ERROR [trace %d, line %d]: %s\n", tracenum, LINENUM(opnum), msg);
 }
 
+/*
+ * parse_size - Read a size in bytes, with an optional K, M or G suffix.
+ *     Returns 0 if it isn't one
+ */
+static size_t parse_size(char *s)
+{
+    char *end;
+    size_t size = strtoul(s, &end, 10);
+
+    switch (*end) {
+    case 'G': case 'g':
+	size <<= 10;
+	/* fall through */
+    case 'M': case 'm':
+	size <<= 10;
+	/* fall through */
+    case 'K': case 'k':
+	size <<= 10;
+	end++;
+    }
+    return *end == '\0' ? size : 0;
+}
+
 /* 
  * usage - Explain the command line arguments
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValPF] [-f <file>] [-t <dir>] [-H <size>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-F         Fault the heap in before the timed runs.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H <size>  Let the heap grow to <size> bytes, suffixed K, M or G.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-P         Back the heap by transparent huge pages, and report their coverage.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+#ifdef MM_THREADS
+    fprintf(stderr, "\t-T <n>     Also time <n> threads running each trace at once.\n");
+#endif
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
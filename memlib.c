@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,28 +11,95 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
 
 #include "memlib.h"
 #include "config.h"
 
+/* 
+ * A region of simulated VM, and the brk pointer into it. The region is
+ * reserved address space, whose pages are committed as the brk passes them
+ */
+struct mem_region {
+    char *start_brk;  /* points to first byte of heap */
+    char *brk;        /* points to last byte of heap */
+    char *commit_brk; /* points past the last committed page */
+    char *zero_brk;   /* committed memory from here on has never been used */
+    char *max_addr;   /* end of the reserved address space */ 
+    size_t pagesize;  /* unit the pages are committed in */
+};
+
+/* A mapping of its own made by mem_map, outside the regions */
+typedef struct mem_mapping {
+    char *start;               /* first byte of the mapping */
+    size_t size;               /* size in bytes, a multiple of the page size */
+    struct mem_mapping *next;  /* next mapping in mem_mappings */
+} mem_mapping_t;
+
 /* private variables */
-static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address */ 
+static mem_region_t mem_default;  /* the region used by mem_sbrk and friends */
+static size_t mem_max_heap = MAX_HEAP;  /* largest size of the heap in any region */
+static int mem_hugepages = 0;     /* set if new regions are backed by huge pages */
+static int mem_prefault = 0;      /* set if the heaps are faulted in up front */
+static mem_mapping_t *mem_mappings = NULL;  /* every mapping made by mem_map */
+static size_t mem_mapped = 0;     /* total size of the mappings */
+#ifdef MM_THREADS
+static pthread_mutex_t mem_map_lock = PTHREAD_MUTEX_INITIALIZER; /* held while using the mappings */
+#endif
+
+static void mem_map_acquire(void);
+static void mem_map_release(void);
+static mem_mapping_t **mem_map_find(void *p);
+static void mem_unmap_all(void);
+
+/*
+ * mem_region_init - reserve the address space of a region of max_size
+ *    bytes. No memory is committed until the heap grows into it.
+ *    Returns -1 if the address space can't be reserved
+ */
+static int mem_region_init(mem_region_t *r, size_t max_size)
+{
+    char *start;
+    size_t slop = mem_hugepages ? HUGE_PAGE : 0;
+
+    /* Reserve a huge page more than asked, to align the region in */
+    start = mmap(NULL, max_size + slop, PROT_NONE, 
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (start == MAP_FAILED)
+	return -1;
+
+    r->pagesize = mem_pagesize();
+    r->start_brk = start;
+    if (mem_hugepages) {
+	/* Give back the address space on either side of the aligned region */
+	r->start_brk = (char *)(((size_t)start + HUGE_PAGE - 1) & 
+				~(HUGE_PAGE - 1));
+	if (r->start_brk > start)
+	    munmap(start, r->start_brk - start);
+	munmap(r->start_brk + max_size, start + slop - r->start_brk);
+	if (madvise(r->start_brk, max_size, MADV_HUGEPAGE) == 0)
+	    r->pagesize = HUGE_PAGE;
+    }
+
+    r->max_addr = r->start_brk + max_size;  /* end of the address space */
+    r->brk = r->start_brk;                  /* heap is empty initially */
+    r->commit_brk = r->start_brk;           /* and has no pages */
+    r->zero_brk = r->start_brk;
+    return 0;
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* reserve the address space we will use to model the available VM */
+    if (mem_region_init(&mem_default, MAX_RESERVE) < 0) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
-
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
 }
 
 /* 
@@ -39,33 +107,28 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_unmap_all();
+    munmap(mem_default.start_brk, mem_default.max_addr - mem_default.start_brk);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and remove the mappings of the previous heap
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    mem_unmap_all();
+    mem_region_reset_brk(&mem_default);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap, and returns the old brk.
  */
-void *mem_sbrk(int incr) 
+void *mem_sbrk(intptr_t incr) 
 {
-    char *old_brk = mem_brk;
-
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
-	errno = ENOMEM;
-	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
-	return (void *)-1;
-    }
-    mem_brk += incr;
-    return (void *)old_brk;
+    return mem_region_sbrk(&mem_default, incr);
 }
 
 /*
@@ -73,7 +136,7 @@ void *mem_sbrk(int incr)
  */
 void *mem_heap_lo()
 {
-    return (void *)mem_start_brk;
+    return mem_region_lo(&mem_default);
 }
 
 /* 
@@ -81,7 +144,7 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return mem_region_hi(&mem_default);
 }
 
 /*
@@ -89,7 +152,37 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return mem_region_size(&mem_default);
+}
+
+/*
+ * mem_set_max_heap - set the largest size the heap of any region can
+ *    grow to, up to the MAX_RESERVE bytes reserved for it
+ */
+void mem_set_max_heap(size_t size)
+{
+    mem_max_heap = size < MAX_RESERVE ? size : MAX_RESERVE;
+}
+
+/*
+ * mem_set_hugepages - back the regions set up from now on, including
+ *    the one of mem_init, by transparent huge pages. They're aligned to
+ *    HUGE_PAGE, advised MADV_HUGEPAGE and committed a huge page at a time
+ */
+void mem_set_hugepages(int on)
+{
+    mem_hugepages = on;
+}
+
+/*
+ * mem_set_prefault - fault the heap of every region in up front. The
+ *    first time a heap grows, the pages up to the limit set by 
+ *    mem_set_max_heap are committed and touched, and they're kept
+ *    committed when it shrinks or is purged
+ */
+void mem_set_prefault(int on)
+{
+    mem_prefault = on;
 }
 
 /*
@@ -99,3 +192,351 @@ size_t mem_pagesize()
 {
     return (size_t)getpagesize();
 }
+
+/*
+ * mem_default_region - return the region used by mem_sbrk and friends
+ */
+mem_region_t *mem_default_region()
+{
+    return &mem_default;
+}
+
+/*
+ * mem_region_zero - returns the address past which the memory of a
+ *    region is known to read as zero, as it was never part of the heap
+ *    since it was committed. The heap grows into fresh memory if the
+ *    brk is at or past it
+ */
+void *mem_region_zero(mem_region_t *r)
+{
+    return (void *)r->zero_brk;
+}
+
+/*
+ * mem_region_max_size - returns the largest size the heap of a region
+ *    can grow to, which is the lesser of its reserve and the limit
+ *    set by mem_set_max_heap
+ */
+size_t mem_region_max_size(mem_region_t *r)
+{
+    size_t size = (size_t)(r->max_addr - r->start_brk);
+
+    return size < mem_max_heap ? size : mem_max_heap;
+}
+
+/*
+ * mem_region_pagesize - returns the unit a region commits pages in,
+ *    which is HUGE_PAGE if it's backed by huge pages
+ */
+size_t mem_region_pagesize(mem_region_t *r)
+{
+    return r->pagesize;
+}
+
+/*
+ * mem_region_create - create a region of its own, reserving address
+ *    space for a heap of up to max_size bytes. The heap is held to
+ *    the limit set by mem_set_max_heap as well. Returns NULL if out
+ *    of memory
+ */
+mem_region_t *mem_region_create(size_t max_size)
+{
+    mem_region_t *r;
+
+    if ((r = (mem_region_t *)malloc(sizeof(mem_region_t))) == NULL)
+	return NULL;
+    if (mem_region_init(r, max_size) < 0) {
+	free(r);
+	return NULL;
+    }
+    return r;
+}
+
+/*
+ * mem_region_destroy - free a region made by mem_region_create
+ */
+void mem_region_destroy(mem_region_t *r)
+{
+    munmap(r->start_brk, r->max_addr - r->start_brk);
+    free(r);
+}
+
+/*
+ * mem_region_reset_brk - reset the brk pointer of a region to make an 
+ *    empty heap. The pages stay committed, for the heap to grow into again
+ */
+void mem_region_reset_brk(mem_region_t *r)
+{
+    r->brk = r->start_brk;
+}
+
+/* 
+ * mem_region_sbrk - mem_sbrk for the heap in a region. The pages the
+ *    heap grows into are committed, and the whole pages it shrinks 
+ *    away from are decommitted, unless the heaps are prefaulted
+ */
+void *mem_region_sbrk(mem_region_t *r, intptr_t incr) 
+{
+    char *old_brk = r->brk;
+    char *commit_brk, *p;
+
+    if (incr < 0) {
+	if (r->brk + incr < r->start_brk) {
+	    errno = EINVAL;
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap...\n");
+	    return (void *)-1;
+	}
+	commit_brk = (char *)(((size_t)(r->brk + incr) + r->pagesize - 1) & 
+			      ~(r->pagesize - 1));
+	if (commit_brk < r->commit_brk && !mem_prefault) {
+	    madvise(commit_brk, r->commit_brk - commit_brk, MADV_DONTNEED);
+	    mprotect(commit_brk, r->commit_brk - commit_brk, PROT_NONE);
+	    r->commit_brk = commit_brk;
+	    if (r->zero_brk > commit_brk)
+		r->zero_brk = commit_brk;
+	}
+	r->brk += incr;
+	return (void *)old_brk;
+    }
+
+    if (((r->brk + incr) > r->max_addr) ||
+	((size_t)(r->brk + incr - r->start_brk) > mem_max_heap)) {
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+
+    if (r->brk + incr > r->commit_brk) {
+	/* A prefaulted heap is committed up to its limit at once */
+	commit_brk = mem_prefault ? r->start_brk + mem_max_heap : r->brk + incr;
+	commit_brk = (char *)(((size_t)commit_brk + r->pagesize - 1) & 
+			      ~(r->pagesize - 1));
+	if (commit_brk > r->max_addr)
+	    commit_brk = r->max_addr;
+	if (mprotect(r->commit_brk, commit_brk - r->commit_brk, 
+		     PROT_READ | PROT_WRITE) < 0) {
+	    errno = ENOMEM;
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Could not commit memory...\n");
+	    return (void *)-1;
+	}
+	if (mem_prefault)
+	    for (p = r->commit_brk; p < commit_brk; p += mem_pagesize())
+		*(volatile char *)p = 0;
+	r->commit_brk = commit_brk;
+    }
+    r->brk += incr;
+    if (r->zero_brk < r->brk)
+	r->zero_brk = r->brk;
+    return (void *)old_brk;
+}
+
+/*
+ * mem_region_lo - return address of the first heap byte in a region
+ */
+void *mem_region_lo(mem_region_t *r)
+{
+    return (void *)r->start_brk;
+}
+
+/* 
+ * mem_region_hi - return address of last heap byte in a region
+ */
+void *mem_region_hi(mem_region_t *r)
+{
+    return (void *)(r->brk - 1);
+}
+
+/*
+ * mem_region_size - returns the heap size of a region in bytes
+ */
+size_t mem_region_size(mem_region_t *r)
+{
+    return (size_t)(r->brk - r->start_brk);
+}
+
+/*
+ * mem_purge - model of madvise(MADV_DONTNEED). The whole pages between
+ *    lo and lo + size are dropped, staying committed but reading as 
+ *    zero when touched again. If the heaps are prefaulted the pages
+ *    are zeroed in place instead, so they aren't faulted in again.
+ *    Returns the number of bytes dropped or zeroed
+ */
+size_t mem_purge(void *lo, size_t size)
+{
+    char *start = (char *)(((size_t)lo + mem_pagesize() - 1) & 
+			   ~(mem_pagesize() - 1));
+    char *end = (char *)(((size_t)lo + size) & ~(mem_pagesize() - 1));
+
+    if (end <= start)
+	return 0;
+    if (mem_prefault)
+	memset(start, 0, end - start);
+    else if (madvise(start, end - start, MADV_DONTNEED) < 0)
+	return 0;
+    return (size_t)(end - start);
+}
+
+/*
+ * mem_map - model of mmap for anonymous memory. Maps size bytes,
+ *    rounded up to whole pages, outside the regions. Returns the
+ *    page-aligned start of the mapping, or NULL if out of memory
+ */
+void *mem_map(size_t size)
+{
+    mem_mapping_t *m;
+    char *p;
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    if ((m = (mem_mapping_t *)malloc(sizeof(mem_mapping_t))) == NULL)
+	return NULL;
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+	free(m);
+	return NULL;
+    }
+
+    m->start = p;
+    m->size = size;
+    mem_map_acquire();
+    m->next = mem_mappings;
+    mem_mappings = m;
+    mem_mapped += size;
+    mem_map_release();
+    return (void *)p;
+}
+
+/*
+ * mem_remap - model of mremap. Resizes the mapping starting at p to
+ *    new_size bytes, rounded up to whole pages. The pages are moved
+ *    rather than copied if the mapping can't grow where it is.
+ *    Returns the new start, or NULL with the mapping unchanged if
+ *    out of memory
+ */
+void *mem_remap(void *p, size_t new_size)
+{
+    mem_mapping_t *m;
+    char *newp;
+
+    new_size = (new_size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    mem_map_acquire();
+    m = *mem_map_find(p);
+    newp = m->size == new_size ? p : mremap(p, m->size, new_size, MREMAP_MAYMOVE);
+    if (newp == MAP_FAILED) {
+	mem_map_release();
+	return NULL;
+    }
+    mem_mapped += new_size - m->size;
+    m->start = newp;
+    m->size = new_size;
+    mem_map_release();
+    return (void *)newp;
+}
+
+/*
+ * mem_extend - grow the mapping starting at p to new_size bytes,
+ *    rounded up to whole pages, without moving it. Returns 0, or -1
+ *    with the mapping unchanged if the pages after it are taken
+ */
+int mem_extend(void *p, size_t new_size)
+{
+    mem_mapping_t *m;
+
+    new_size = (new_size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    mem_map_acquire();
+    m = *mem_map_find(p);
+    if (new_size <= m->size) {
+	mem_map_release();
+	return 0;
+    }
+    if (mremap(p, m->size, new_size, 0) == MAP_FAILED) {
+	mem_map_release();
+	return -1;
+    }
+    mem_mapped += new_size - m->size;
+    m->size = new_size;
+    mem_map_release();
+    return 0;
+}
+
+/*
+ * mem_unmap - remove the mapping starting at p
+ */
+void mem_unmap(void *p)
+{
+    mem_mapping_t **mp, *m;
+
+    mem_map_acquire();
+    mp = mem_map_find(p);
+    m = *mp;
+    *mp = m->next;
+    mem_mapped -= m->size;
+    mem_map_release();
+
+    munmap(m->start, m->size);
+    free(m);
+}
+
+/*
+ * mem_map_contains - check whether the bytes lo to hi lie within one mapping
+ */
+int mem_map_contains(void *lo, void *hi)
+{
+    mem_mapping_t *m;
+    int found = 0;
+
+    mem_map_acquire();
+    for (m = mem_mappings; m != NULL && !found; m = m->next)
+	found = (char *)lo >= m->start && (char *)hi < m->start + m->size;
+    mem_map_release();
+    return found;
+}
+
+/*
+ * mem_mapsize - returns the total size of the mappings in bytes
+ */
+size_t mem_mapsize()
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_map_acquire - lock the mappings, in thread-safe builds
+ */
+static void mem_map_acquire()
+{
+#ifdef MM_THREADS
+    pthread_mutex_lock(&mem_map_lock);
+#endif
+}
+
+/*
+ * mem_map_release - unlock the mappings
+ */
+static void mem_map_release()
+{
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&mem_map_lock);
+#endif
+}
+
+/*
+ * mem_map_find - return the link to the mapping starting at p, which
+ *    must exist. The mappings must be locked
+ */
+static mem_mapping_t **mem_map_find(void *p)
+{
+    mem_mapping_t **mp;
+
+    for (mp = &mem_mappings; (*mp)->start != (char *)p; mp = &(*mp)->next)
+	;
+    return mp;
+}
+
+/*
+ * mem_unmap_all - remove every mapping
+ */
+static void mem_unmap_all()
+{
+    while (mem_mappings != NULL)
+	mem_unmap(mem_mappings->start);
+}
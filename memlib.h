@@ -1,11 +1,39 @@
 #include <unistd.h>
 
+/* A simulated heap, with its own storage and brk pointer */
+typedef struct mem_region mem_region_t;
+
 void mem_init(void);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+void mem_set_max_heap(size_t size);
+void mem_set_hugepages(int on);
+void mem_set_prefault(int on);
+
+/* The region behind the functions above, set up by mem_init */
+mem_region_t *mem_default_region(void);
+
+mem_region_t *mem_region_create(size_t max_size);
+void mem_region_destroy(mem_region_t *r);
+void *mem_region_sbrk(mem_region_t *r, intptr_t incr);
+void mem_region_reset_brk(mem_region_t *r);
+void *mem_region_lo(mem_region_t *r);
+void *mem_region_hi(mem_region_t *r);
+size_t mem_region_size(mem_region_t *r);
+size_t mem_region_max_size(mem_region_t *r);
+size_t mem_region_pagesize(mem_region_t *r);
+void *mem_region_zero(mem_region_t *r);
+size_t mem_purge(void *lo, size_t size);
 
+/* Mappings of their own, outside the regions, for blocks too large for a heap */
+void *mem_map(size_t size);
+void *mem_remap(void *p, size_t new_size);
+int mem_extend(void *p, size_t new_size);
+void mem_unmap(void *p);
+int mem_map_contains(void *lo, void *hi);
+size_t mem_mapsize(void);
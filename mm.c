@@ -7,18 +7,125 @@
  * |hdr |next|prev|data|ftr|
  * |-----------------------|
  * The header and footer contain the size and allocation state
+ * Only free blocks have a footer, as it's only read when coalescing with a free block. Allocated blocks are just:
+ * |--------|
+ * |hdr|data|
+ * |--------|
+ * Instead the header also tells whether the previous block is allocated, so coalesce knows when the footer before it is there.
  * The next pointer points to the next block in the linked list, or null if it's the root.
  * The prev pointer points to the previous block in the linked list, or null if it's the last block of the list.
+ * Both are stored in a word as the number of double words from the start of the heap, so they fit in 64-bit builds as well.
+ * Offset 0 is the alignment padding, which no block starts at, so it's used for null.
  * The method follows the last in first out (LIFO) principle
  *
+ * Free blocks are segregated by size into NUM_CLASSES lists, each holding blocks in the range (MIN_CLASS << (i - 1), MIN_CLASS << i].
+ * A fit is found by searching the class of the request first-fit,
+ * and otherwise taking the head of the first non-empty larger class, as any block in there is large enough.
+ *
+ * Free blocks larger than TREE_MIN are kept in a splay tree instead, ordered by size and then address.
+ * The tree reuses the next and prev pointers as the left and right child, so it needs no more room than the lists.
+ * Fits for large requests are found best-fit in the tree. Inserting and removing splays the block to the root,
+ * which keeps the tree balanced over a series of operations.
+ *
+ * Requests of SLAB_MAX bytes or less are served from slabs instead. A slab is an allocated block of SLAB_SIZE bytes,
+ * whose payload starts DSIZE into a SLAB_SIZE aligned page. Slabs placed after each other thereby tile the pages exactly.
+ * The payload is split into slots of one size. The slots have no header, instead the slab starts with a header of its own:
+ * |---------------------------------------------|
+ * |next|prev|slot size|used|bitmap|slot|slot|...|
+ * |---------------------------------------------|
+ * The next and prev pointers link the slabs of a size class that have free slots, like the free lists.
+ * The bitmap has a bit per slot, which is set while the slot is in use. Whether a pointer is inside a slab
+ * is looked up in slab_map, which has a bit per SLAB_SIZE page the heap can grow to. Empty slabs are freed back to the heap.
+ *
+ * mm_memalign places blocks the way slabs are placed, at the first aligned payload of a free block that leaves room
+ * for a free block before it, and splits that leading fragment back into the free lists. When no free block fits,
+ * the heap is extended just enough for the aligned block.
+ *
+ * mm_malloc_batch finds a single fit for a whole batch of blocks of one size, and splits it into the blocks in
+ * address order. mm_free_batch sorts the blocks by address, and joins the ones next to each other before freeing them,
+ * so a run of neighbours is coalesced and put back in the lists as one block.
+ *
  * Another difference in this implementation is the attempt to uses succeeding blocks in realloc, to improve memory usages.
+ * A block grows in place into the free blocks on either side of it, or the heap when it's the last block,
+ * and any excess is split off again. Shrinking a block frees its tail.
+ * Blocks grown by less than half their size are marked GROWN. When one has to move for another such step it is
+ * likely being appended to, so it goes to the end of the heap with half its size again as headroom. Only a shrink
+ * into that headroom leaves the tail in place.
+ * mm_expand grows a block the same way, but only into the free block after it or the end of the heap, so the payload
+ * never moves, and takes up to as much as the caller asks for rather than what it needs.
+ *
+ * Once the free block at the end of the heap grows MM_TRIM_THRESHOLD bytes past the top pad of the heap, free gives
+ * the whole pages of it beyond the pad back to memlib, by shrinking the heap with a negative mem_sbrk. The pad keeps a
+ * heap that shrinks and grows again from trimming and committing the same pages over and over. It starts at MM_TOP_PAD,
+ * and is raised by how far the heap grows back past where it was last trimmed, up to MM_TOP_PAD_MAX, so a heap that
+ * spikes to the same size again and again keeps the pages after the first time. A pad that isn't raised for
+ * MM_TOP_PAD_DECAY frees is halved, down to MM_TOP_PAD, so once the spikes stop the heap gives their pages back.
+ * mm_trim does the same on request, with a pad of the caller's choosing.
+ * Free blocks in the middle of the heap can't be given back that way, but the pages inside those in the tree can be
+ * dropped with mem_purge, leaving the tags and pointers at either end. Blocks purged are marked CLEAN, so they
+ * aren't purged again. The ones that aren't are kept in a dirty list as well, in the order they went dirty, linked
+ * through the 2 words after the list pointers and stamped with the number of frees the heap had made, and their bytes
+ * are counted. Once they pass MM_PURGE_THRESHOLD free purges the blocks that have stayed dirty for MM_PURGE_AGE frees,
+ * so memory freed lately, which is the most likely to be used again, keeps its pages. mm_purge purges the whole list
+ * on request. The block at the end of the heap is left out of the list, as trimming looks after it. Merging a block
+ * makes it dirty again, while the rest of a CLEAN block that is split stays CLEAN. Blocks the heap grows into memory
+ * it never had are CLEAN from the start.
+ * As the whole pages of a CLEAN block read as zero, mm_calloc only zeroes the payload outside them.
+ *
+ * In a region memlib backs by transparent huge pages, the heap grows and shrinks a huge page at a time instead,
+ * so every page it commits can be a huge one.
+ *
+ * Requests larger than the huge threshold of the heap are given a memlib mapping of their own instead, and realloc
+ * resizes the mapping, which moves the pages rather than copying them. Freeing one unmaps it at once, leaving nothing
+ * behind in the heap. A huge block is tagged with a header of size 0 that is allocated, like the epilogue, and
+ * the size of its mapping is kept in the word before. A huge_t right before those links the huge blocks of a heap.
+ * The payload is HUGE_HDR into the mapping, or further for memalign, which can align it to up to a page.
+ * The threshold starts at MM_HUGE_THRESHOLD, and is raised to the size of each huge block freed,
+ * up to MM_HUGE_THRESHOLD_MAX, so sizes that come and go are served from the heap rather than mapped every time.
+ * It's never raised past 1 / MM_HUGE_THRESHOLD_SHARE of the heap limit, so the heap can hold several of them,
+ * and a request the heap can't hold once it's full gets a mapping anyway, whatever its size.
+ *
+ * An mm_arena_t hands out scratch memory by bumping a pointer through chunks it takes from the default heap, and
+ * frees it all at once, by giving back the chunks. These arenas have nothing to do with the arenas of the thread-safe
+ * build below. A full chunk is first grown in place with mm_expand, so an arena at the end of the heap takes a single
+ * chunk. mm_arena_mark and mm_arena_release roll an arena back to an earlier top, freeing the chunks taken since.
+ *
+ * All state of a heap is kept in an mm_heap_t, which is passed to every function working on it.
+ * mm_malloc, mm_free and mm_realloc use a default heap in the memlib default region,
+ * while mm_heap_create makes independent heaps, each growing into a memlib region of its own.
+ *
+ * Built with MM_THREADS, mm_malloc, mm_free and mm_realloc are thread-safe. Threads are spread round-robin over
+ * MM_ARENAS heaps, the first being the default heap, and each with a lock of its own. A block is freed into
+ * the arena whose region it is in, whichever thread frees it. A thread freeing a block of another arena doesn't
+ * take its lock, but pushes the block onto a lock-free list of the arena, which is drained on its next allocation.
+ *
+ * In front of the arenas, every thread caches up to MM_TCACHE_DEPTH freed blocks of each multiple of DSIZE up to
+ * TCACHE_MAX bytes. The cached blocks stay allocated in the arena, so they're handed out again without locking.
+ * An empty bin is refilled, and a full bin flushed, TCACHE_BATCH blocks at a time under a single lock.
+ *
+ * Built with MM_RSEQ as well, threads share a cache per CPU instead, so the cached memory grows with the number of
+ * CPUs rather than threads. Blocks are pushed and popped with restartable sequences, which the kernel aborts
+ * if the thread is preempted or migrated before the commit. Threads glibc couldn't register an rseq area for
+ * keep using caches of their own.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+// The caches of the CPUs sit in front of the arenas, so they need the thread-safe build
+#if defined(MM_RSEQ) && !defined(MM_THREADS)
+#define MM_THREADS
+#endif
+
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
+#ifdef MM_RSEQ
+#include <sys/rseq.h>
+#endif
 
 #include "memlib.h"
 #include "mm.h"
+#include "config.h"
 
 team_t team = {
     "albn",
@@ -32,15 +139,90 @@ team_t team = {
 #define DSIZE 8             // Double word size
 #define CHUNKSIZE (1 << 12) // Used as the size to extend the heap with. 4096 bytes.
 
+// Segregated free list constants
+#define NUM_CLASSES 9  // Number of size classes, and thereby free lists. The last is bounded by TREE_MIN
+#define MIN_CLASS 16   // Upper size bound of the first class. Equal to the minimum block size
+#define TREE_MIN 4096  // Free blocks larger than this are kept in the tree
+
+// Number of heaps the threads are spread over, in thread-safe builds
+#ifndef MM_ARENAS
+#define MM_ARENAS 8
+#endif
+
+// Per-thread cache constants, in thread-safe builds
+#ifndef MM_TCACHE_DEPTH
+#define MM_TCACHE_DEPTH 32 // Most blocks a thread caches of each size. 0 turns the caches off
+#endif
+#define TCACHE_MAX 256                           // Largest payload kept in the caches
+#define TCACHE_BINS (TCACHE_MAX / DSIZE)         // One bin for every multiple of DSIZE up to TCACHE_MAX
+#define TCACHE_BATCH ((MM_TCACHE_DEPTH + 1) / 2) // Blocks moved between a cache and its arena under one lock
+
+// Heap trimming constants
+#ifndef MM_TRIM_THRESHOLD
+#define MM_TRIM_THRESHOLD (1 << 17) // Free space at the end of the heap past the top pad beyond which it's given back. 0 never does
+#endif
+#ifndef MM_TOP_PAD
+#define MM_TOP_PAD (1 << 17) // Free space free leaves at the end of the heap when it gives the rest back, at first
+#endif
+#ifndef MM_TOP_PAD_MAX
+#define MM_TOP_PAD_MAX (1 << 24) // Largest the top pad is raised to by the heap growing back after a trim. 16 MB
+#endif
+#ifndef MM_TOP_PAD_DECAY
+#define MM_TOP_PAD_DECAY (1 << 14) // Frees after which a top pad that wasn't raised is halved, down to MM_TOP_PAD
+#endif
+
+// Huge block constants
+#ifndef MM_HUGE_THRESHOLD
+#define MM_HUGE_THRESHOLD (1 << 20) // Requests larger than this get a mapping of their own, at first. 1 MB
+#endif
+#ifndef MM_HUGE_THRESHOLD_MAX
+#define MM_HUGE_THRESHOLD_MAX (1 << 25) // Largest the threshold is raised to by the huge blocks freed. 32 MB
+#endif
+#ifndef MM_HUGE_THRESHOLD_SHARE
+#define MM_HUGE_THRESHOLD_SHARE 8 // The threshold is raised to no more than this share of the heap limit, as 1 / n
+#endif
+
+// Purging constant
+#ifndef MM_PURGE_THRESHOLD
+#define MM_PURGE_THRESHOLD (1 << 20) // Bytes in the dirty list beyond which free purges the ones aged. 0 never does
+#endif
+#ifndef MM_PURGE_AGE
+#define MM_PURGE_AGE (1 << 14) // Frees a block stays in the dirty list for before free purges it
+#endif
+
+// Turn a macro into a string, for use in inline assembly
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+// Slab constants
+#define SLAB_SIZE (1 << 10)                       // Size of a slab block, and the page it's aligned to. 1024 bytes.
+#define SLAB_MAX 64                               // Largest request served from a slab
+#define SLAB_CLASSES (SLAB_MAX / DSIZE)           // Number of slot sizes, one for every multiple of DSIZE up to SLAB_MAX
+#define SLAB_MAP_WORDS 4                          // Number of words in the slot bitmap. Enough for the slots of the smallest size
+#define SLAB_HDR ((4 + SLAB_MAP_WORDS) * WSIZE)   // Size of the slab header, before the first slot
+
+// Huge block constants
+#define HUGE_HDR (4 * DSIZE) // Offset of the payload of a huge block past its huge_t, size and header
+
+// Largest block size that fits in a header
+#define MAX_BLOCK (~0u & ~0x7)
+
 // Get the max of 2 numbers
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
+// Get the min of 2 numbers
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
 
-// Pack the size and allocated bit into a word. Used for headers and footers
+// Pack the size and allocated bits into a word. Used for headers and footers
 // Packed together as:
-// 16           2       0
-// | size       | alloc |
+// 16           2            1       0
+// | size       | prev alloc | alloc |
+// The prev alloc bit is only kept in headers
 #define PACK(size, alloc) ((size) | (alloc))
 
+#define PREV_ALLOC 0x2 // Set in the header when the previous block is allocated
+#define GROWN 0x4      // Set in the header of an allocated block that realloc has grown by a small step
+#define CLEAN 0x4      // Set in the header of a free block whose whole pages read as zero. Free blocks are never GROWN
+
 // Get a word address p. Used to read the header/footer
 #define GET(p) (*(unsigned int *)(p))
 // Write a word onto address p. Used to write the header/footer
@@ -50,65 +232,366 @@ team_t team = {
 #define GET_SIZE(p) (GET(p) & ~0x7) // Works by ignoring the first 3 bits, which are used by the allocator
 // Read the allocation data of a block from the header/footer. Works by only getting the first bit.
 #define GET_ALLOC(p) (GET(p) & 0x1)
+// Read whether the previous block is allocated from a header
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
 
 // Compute the address of the header, from a pointer to the data location
 #define HDRP(bp) ((char *)(bp)-WSIZE)
-// Compute the address of the footer, from a pointer to the data location
+// Compute the address of the footer, from a pointer to the data location. Only free blocks have one
 #define FTRP(bp) ((char *)bp + GET_SIZE(HDRP(bp)) - DSIZE)
 
 // Compute the location of the next block by the data location of a block
 #define NEXT_BLKP(bp) ((char *)bp + GET_SIZE((char *)(bp)-WSIZE))
-// Compute the location of the previous block by the data location of a block
+// Compute the location of the previous block by the data location of a block. Only possible if the previous block is free
 #define PREV_BLKP(bp) ((char *)bp - GET_SIZE((char *)(bp)-DSIZE))
 
+// Mark the block after bp as having an allocated previous block
+#define SET_NEXT_PREV_ALLOC(bp) PUT(HDRP(NEXT_BLKP(bp)), GET(HDRP(NEXT_BLKP(bp))) | PREV_ALLOC)
+// Mark the block after bp as having a free previous block
+#define CLEAR_NEXT_PREV_ALLOC(bp) PUT(HDRP(NEXT_BLKP(bp)), GET(HDRP(NEXT_BLKP(bp))) & ~PREV_ALLOC)
+
 // Get the location of the pointer to the next block
 #define NEXT_FBLKP(bp) ((char *)bp)
 // Get the location of the pointer to the next block
 #define PREV_FBLKP(bp) ((char *)bp+WSIZE)
 
+// Compress a pointer into the heap to a word, by counting double words from the start of the heap
+#define TO_OFFSET(h, p) ((p) == NULL ? 0 : (unsigned int)(((char *)(p) - (h)->heap_basep) / DSIZE))
+// Expand a word written by TO_OFFSET back to a pointer
+#define FROM_OFFSET(h, o) ((o) == 0 ? NULL : (void *)((h)->heap_basep + (size_t)(o) * DSIZE))
+
 // Get the pointer to the next free block
-#define NEXT_FBLK(bp) ((void *)GET(NEXT_FBLKP(bp)))
+#define NEXT_FBLK(h, bp) FROM_OFFSET(h, GET(NEXT_FBLKP(bp)))
 // Get the pointer to the next free block
-#define PREV_FBLK(bp) ((void *)GET(PREV_FBLKP(bp)))
-
-static char *heap_listp = 0; // Pointer to the first block. Set in mm_init
-static char *first_freep = 0; // Pointer to the first free block
+#define PREV_FBLK(h, bp) FROM_OFFSET(h, GET(PREV_FBLKP(bp)))
+
+// Get the left child of a block in the tree, which is kept in the next pointer
+#define TREE_LEFT(h, bp) NEXT_FBLK(h, bp)
+// Get the right child of a block in the tree, which is kept in the prev pointer
+#define TREE_RIGHT(h, bp) PREV_FBLK(h, bp)
+
+// Get the location of the pointer to the next block in the dirty list, in the word after the list pointers
+#define DIRTY_NEXTP(bp) ((char *)(bp) + 2 * WSIZE)
+// Get the location of the pointer to the previous block in the dirty list
+#define DIRTY_PREVP(bp) ((char *)(bp) + 3 * WSIZE)
+// Get the location of the number of frees the heap had made when a block joined the dirty list
+#define DIRTY_AGEP(bp) ((char *)(bp) + 4 * WSIZE)
+// Written as the next dirty pointer of a block in the tree that isn't in the dirty list
+#define DIRTY_NONE (~0u)
+// Compute the end of the words at the start of a block in the tree that a purge keeps, up to and including its age
+#define DIRTY_END(bp) ((char *)(bp) + 3 * DSIZE)
+
+// Get the slab class of a request of size bytes
+#define SLAB_CLASS(size) (((size) - 1) / DSIZE)
+// Get the location of the slot size of a slab. The next and prev pointers are at the same place as in a free block
+#define SLAB_SLOTP(sp) ((char *)(sp) + 2 * WSIZE)
+// Get the location of the number of used slots of a slab
+#define SLAB_USEDP(sp) ((char *)(sp) + 3 * WSIZE)
+// Get the slot bitmap of a slab
+#define SLAB_BITMAP(sp) ((unsigned int *)((char *)(sp) + 4 * WSIZE))
+// Compute the number of slots of a given size that fit in the payload of a slab
+#define SLAB_SLOTS(slot) ((SLAB_SIZE - DSIZE - SLAB_HDR) / (slot))
+// Compute the start of the page a pointer is in
+#define SLAB_PAGE(p) ((char *)((size_t)(p) & ~(size_t)(SLAB_SIZE - 1)))
+// Compute the payload of the slab a slot is in. The page starts with the last word of the block before and the header of the slab
+#define SLAB_BASE(p) (SLAB_PAGE(p) + DSIZE)
+// Compute the bit of the page a pointer is in, in slab_map
+#define SLAB_INDEX(h, p) ((size_t)(SLAB_PAGE(p) - SLAB_PAGE((h)->heap_basep)) / SLAB_SIZE)
+
+// Get the huge block a payload is in
+#define HUGE_BLK(bp) ((huge_t *)((char *)(bp) - HUGE_HDR))
+// Get the start of the mapping of a huge block, the page its huge_t is in
+#define HUGE_MAP(bp) ((void *)((size_t)HUGE_BLK(bp) & ~(mem_pagesize() - 1)))
+// Get the payload size of a huge block, the rest of its mapping
+#define HUGE_SIZE(bp) (GET(HUGE_SIZEP(bp)) - (size_t)((char *)(bp) - (char *)HUGE_MAP(bp)))
+// Get the payload of a huge block
+#define HUGE_PAYLOAD(hp) ((char *)(hp) + HUGE_HDR)
+// Get the location of the size of the mapping of a huge block, in the word before its header
+#define HUGE_SIZEP(bp) ((char *)(bp) - DSIZE)
+
+// The start of the mapping of a huge block
+typedef struct huge {
+  mm_heap_t *heap; // The heap the block belongs to
+  struct huge *next; // The next huge block of the heap
+  struct huge *prev; // The previous huge block of the heap
+} huge_t;
+
+// The state of a heap. Every function working on a heap is passed the one to use
+struct mm_heap {
+  mem_region_t *region; // The memory the heap grows into
+  char *heap_basep; // Pointer to the start of the heap, which list pointers are relative to. Set in heap_init
+  char *heap_listp; // Pointer to the first block. Set in heap_init
+  char *seg_listp[NUM_CLASSES]; // Pointer to the first free block of each size class
+  char *tree_rootp; // Pointer to the root of the tree of large free blocks
+  char *dirty_headp; // The block in the dirty list that went dirty first, which is purged first
+  char *dirty_tailp; // The block in the dirty list that went dirty last
+  size_t dirty_size; // Bytes of the blocks in the dirty list
+  unsigned int frees; // Number of blocks freed, the clock the blocks in the dirty list age by
+  char *slab_listp[SLAB_CLASSES]; // Pointer to the first slab with free slots of each slab class
+  unsigned char *slab_map; // Bit set for each page of the heap that is a slab, up to the limit of its region
+  size_t slab_map_size; // Number of bytes in slab_map
+  size_t slab_map_top; // Number of bytes at the start of slab_map that may have bits set
+  huge_t *huge_listp; // Pointer to the first huge block
+  size_t huge_min; // Requests larger than this get a mapping of their own. Raised by the huge blocks freed
+  size_t top_pad; // Free space free leaves at the end of the heap when trimming. Raised by the heap growing back
+  char *trim_brkp; // The brk free last trimmed the heap to, or NULL if it hasn't
+  unsigned int pad_frees; // Number of blocks freed when the top pad was last raised or halved
+#ifdef MM_THREADS
+  pthread_mutex_t lock; // Held while the heap is used through mm_malloc, mm_free or mm_realloc
+  char *remote_freep; // Blocks freed by threads of other arenas, linked through their payload. Pushed without the lock
+#endif
+};
+
+// A chunk an mm_arena_t has taken from the heap. The memory handed out follows it, up to the end of the block
+typedef struct arena_chunk {
+  struct arena_chunk *prevp; // The chunk taken before it
+  char *endp; // The end of the payload of the block
+} arena_chunk_t;
+
+// Scratch memory, handed out by bumping a pointer through chunks of the heap
+struct mm_arena {
+  size_t chunk_size; // Bytes of payload to take from the heap at a time
+  arena_chunk_t *chunkp; // The last chunk taken, which is allocated from
+  char *topp; // The first free byte of the last chunk
+};
+
+// Size of the arena_chunk_t at the start of a chunk, rounded up so the memory after it stays aligned
+#define ARENA_HDR ((sizeof(arena_chunk_t) + DSIZE - 1) & ~(size_t)(DSIZE - 1))
+// Get the start of the memory of an arena chunk
+#define ARENA_START(cp) ((char *)(cp) + ARENA_HDR)
+
+#ifdef MM_THREADS
+static mm_heap_t default_heap = {.lock = PTHREAD_MUTEX_INITIALIZER}; // Arena 0, in the memlib default region
+static mm_heap_t *arenas[MM_ARENAS]; // The heaps threads allocate from. Created when the first thread is given one
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER; // Held while creating an arena
+static unsigned int next_arena = 0; // Arena to give the next thread, round-robin
+static __thread mm_heap_t *thread_heapp = NULL; // Arena of the calling thread
+
+// A cache of blocks a thread has freed, kept allocated in its arena to be handed out again without locking.
+// Bin i holds blocks with at least (i + 1) * DSIZE bytes of payload, linked through the first word of the payload
+typedef struct {
+  char *binp[TCACHE_BINS]; // Pointer to the first block of each bin
+  unsigned int count[TCACHE_BINS]; // Number of blocks in each bin
+} tcache_t;
+
+static __thread tcache_t tcache; // Cache of the calling thread
+static pthread_key_t tcache_key; // Flushes the cache of a thread when it exits
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+#ifdef MM_RSEQ
+// The cache of a CPU. Slot i of a bin holds a block while i is below the count of the bin, like a stack.
+// Blocks are pushed and popped by restartable sequences, which are aborted if the thread leaves the CPU before
+// storing the new count. The cache takes blocks of any arena, as they're freed into their own arena when flushed
+typedef struct {
+  unsigned long count[TCACHE_BINS]; // Number of blocks in each bin
+  char *slotp[TCACHE_BINS][MM_TCACHE_DEPTH]; // The blocks of each bin
+} __attribute__((aligned(64))) cpu_cache_t;
+
+static cpu_cache_t *cpu_caches = NULL; // Cache of each CPU. Stays NULL if the threads have no rseq area
+static unsigned int num_cpus = 0; // Number of CPUs with a cache
+static pthread_once_t cpu_caches_once = PTHREAD_ONCE_INIT;
+static __thread int thread_percpu = 0; // Set if the thread uses the caches of the CPUs instead of its own
+#endif
+#else
+static mm_heap_t default_heap; // The heap behind mm_malloc, mm_free and mm_realloc, in the memlib default region
+#endif
 
 // Prototypes, so we can call the methods before being defined
-static void *extend_heap(size_t words);
-static void place(void *bp, size_t asize);
-static void *find_fit(size_t asize);
-static void *coalesce(void *bp);
-static void printblock(void *bp);
-static void checkheap(int verbose, char name[]);
-static void checkblock(void *bp);
+static int heap_init(mm_heap_t *h);
+static mm_heap_t *acquire_heap(void *bp);
+static void release_heap(mm_heap_t *h);
+#ifdef MM_THREADS
+static int owns_block(mm_heap_t *h, void *bp);
+static mm_heap_t *find_arena(void *bp);
+static mm_heap_t *thread_init(void);
+static int cache_bin(mm_heap_t *h, void *bp);
+static void remote_free(mm_heap_t *h, void *bp);
+static void drain_remote(mm_heap_t *h);
+static void *tcache_alloc(size_t size);
+static int tcache_free(void *bp);
+static void tcache_flush(mm_heap_t *h, int bin, unsigned int n);
+static void tcache_key_create(void);
+static void tcache_destroy(void *arg);
+#endif
+#ifdef MM_RSEQ
+static void cpu_caches_create(void);
+static struct rseq *thread_rseq(void);
+static char *percpu_pop(int bin);
+static int percpu_push(int bin, void *bp);
+static void *percpu_alloc(size_t size);
+static int percpu_free(void *bp);
+#endif
+static void arena_free(void *bp);
+static void trim_top(mm_heap_t *h, void *bp);
+static void free_sorted(mm_heap_t *h, void **ptrs, size_t n);
+static int ptr_cmp(const void *a, const void *b);
+static void *extend_heap(mm_heap_t *h, size_t words);
+static void *block_alloc(mm_heap_t *h, size_t size, char **lop, char **hip);
+static void place(mm_heap_t *h, void *bp, size_t asize);
+static void shrink_block(mm_heap_t *h, void *bp, size_t asize);
+static void *tail_fit(mm_heap_t *h, size_t asize);
+static void *find_fit(mm_heap_t *h, size_t asize);
+static void *coalesce(mm_heap_t *h, void *bp);
+static void printblock(mm_heap_t *h, void *bp);
+static void checkheap(mm_heap_t *h, int verbose, char name[]);
+static void checkblock(mm_heap_t *h, void *bp);
 static size_t get_alligned(size_t size);
-
-static void set_next_fblkp(void *bp, void *next);
-static void set_prev_fblkp(void *bp, void *next);
-static void insert_in_empty_list(void *bp);
-static void remove_from_empty_list(void *bp);
+static int get_class(size_t size);
+
+static void set_next_fblkp(mm_heap_t *h, void *bp, void *next);
+static void set_prev_fblkp(mm_heap_t *h, void *bp, void *next);
+static void insert_in_empty_list(mm_heap_t *h, void *bp);
+static void remove_from_empty_list(mm_heap_t *h, void *bp);
+static void link_block(mm_heap_t *h, char **rootp, void *bp);
+static void dirty_link(mm_heap_t *h, void *bp);
+static void dirty_unlink(mm_heap_t *h, void *bp);
+static size_t purge_dirty(mm_heap_t *h, unsigned int age);
+static void unlink_block(mm_heap_t *h, char **rootp, void *bp);
+
+static int tree_cmp(size_t size, void *addr, void *bp);
+static char *splay(mm_heap_t *h, char *t, size_t size, void *addr);
+static void tree_insert(mm_heap_t *h, void *bp);
+static void tree_remove(mm_heap_t *h, void *bp);
+static void *tree_best_fit(mm_heap_t *h, size_t asize);
+static void *tree_aligned_fit(mm_heap_t *h, char *t, size_t asize, size_t limit, size_t align, size_t skew);
+static size_t checktree(mm_heap_t *h, void *bp, void *lo, void *hi);
+
+static char *aligned_payload(void *bp, size_t align, size_t skew);
+static void *find_aligned_fit(mm_heap_t *h, size_t asize, size_t align, size_t skew);
+static void *extend_heap_aligned(mm_heap_t *h, size_t asize, size_t align, size_t skew);
+static void *place_aligned(mm_heap_t *h, void *bp, size_t asize, size_t align, size_t skew);
+
+static int is_slab(mm_heap_t *h, void *p);
+static void *slab_alloc(mm_heap_t *h, size_t size);
+static void slab_free(mm_heap_t *h, void *p);
+static void *slab_create(mm_heap_t *h, int class);
+static void checkslab(void *sp);
+
+static int is_huge(mm_heap_t *h, void *bp);
+static void *huge_alloc(mm_heap_t *h, size_t size);
+static void *huge_memalign(mm_heap_t *h, size_t align, size_t size);
+static void huge_free(mm_heap_t *h, void *bp);
+static void *huge_realloc(mm_heap_t *h, void *bp, size_t size);
+static int huge_expand(mm_heap_t *h, void *bp, size_t size);
 
 /*
  * mm_init - Initialize the memory manager
  */
 int mm_init(void) {
+#ifdef MM_THREADS
+  int i;
+
+  // Empty the other arenas as well, keeping their regions for the threads to come.
+  // The blocks in the cache of this thread go with them
+  memset(&tcache, 0, sizeof(tcache));
+#ifdef MM_RSEQ
+  if (cpu_caches != NULL)
+    memset(cpu_caches, 0, num_cpus * sizeof(cpu_cache_t));
+#endif
+  arenas[0] = &default_heap;
+  for (i = 1; i < MM_ARENAS; i++) {
+    if (arenas[i] != NULL) {
+      mem_region_reset_brk(arenas[i]->region);
+      if (heap_init(arenas[i]) == -1)
+        return -1;
+    }
+  }
+#endif
+  default_heap.region = mem_default_region();
+  return heap_init(&default_heap);
+}
+
+/*
+ * mm_heap_create - Create a heap of its own, in a new memlib region. Returns NULL if out of memory
+ */
+mm_heap_t *mm_heap_create(void) {
+  mm_heap_t *h;
+
+  // Zeroed, as heap_init only makes slab_map if it has none large enough
+  if ((h = calloc(1, sizeof(mm_heap_t))) == NULL)
+    return NULL;
+  if ((h->region = mem_region_create(MAX_RESERVE)) == NULL) {
+    free(h);
+    return NULL;
+  }
+#ifdef MM_THREADS
+  pthread_mutex_init(&h->lock, NULL);
+#endif
+  if (heap_init(h) == -1) {
+    mm_heap_destroy(h);
+    return NULL;
+  }
+
+  return h;
+}
+
+/*
+ * mm_heap_destroy - Release a heap made by mm_heap_create, and every block in it
+ */
+void mm_heap_destroy(mm_heap_t *h) {
+  while (h->huge_listp != NULL)
+    huge_free(h, HUGE_PAYLOAD(h->huge_listp));
+#ifdef MM_THREADS
+  pthread_mutex_destroy(&h->lock);
+#endif
+  mem_region_destroy(h->region);
+  free(h->slab_map);
+  free(h);
+}
+
+/*
+ * heap_init - Start an empty heap at the brk of its region
+ */
+static int heap_init(mm_heap_t *h) {
+  size_t size;
+  int i;
+
+  // Empty the free lists and forget the slabs, as the heap may have been reset
+  for (i = 0; i < NUM_CLASSES; i++)
+    h->seg_listp[i] = NULL;
+  h->tree_rootp = NULL;
+  h->dirty_headp = NULL;
+  h->dirty_tailp = NULL;
+  h->dirty_size = 0;
+  h->frees = 0;
+  h->huge_listp = NULL;
+  h->huge_min = MM_HUGE_THRESHOLD;
+  h->top_pad = MM_TOP_PAD;
+  h->trim_brkp = NULL;
+  h->pad_frees = 0;
+#ifdef MM_THREADS
+  h->remote_freep = NULL;
+#endif
+  for (i = 0; i < SLAB_CLASSES; i++)
+    h->slab_listp[i] = NULL;
+  // The map covers the heap up to the limit of its region, which may have been raised since the map was made.
+  // Only the part that was used needs clearing otherwise
+  size = mem_region_max_size(h->region) / SLAB_SIZE / 8 + 1;
+  if (size > h->slab_map_size) {
+    free(h->slab_map);
+    h->slab_map_size = 0;
+    if ((h->slab_map = calloc(size, 1)) == NULL)
+      return -1;
+    h->slab_map_size = size;
+  } else {
+    memset(h->slab_map, 0, h->slab_map_top);
+  }
+  h->slab_map_top = 0;
+
   // Create the initial empty heap 
-  if ((heap_listp = mem_sbrk(4 * WSIZE)) == (void *)-1)
+  if ((h->heap_listp = mem_region_sbrk(h->region, 4 * WSIZE)) == (void *)-1)
     return -1;
-  PUT(heap_listp, 0);                            // Alignment padding
-  PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1)); // Prologue header
-  PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1)); // Prologue footer
-  PUT(heap_listp + (3 * WSIZE), PACK(0, 1));     // Epilogue header 
-  heap_listp += (2 * WSIZE); // Placed on prologue footer
+  h->heap_basep = h->heap_listp;
+  PUT(h->heap_listp, 0);                            // Alignment padding
+  PUT(h->heap_listp + (1 * WSIZE), PACK(DSIZE, 1)); // Prologue header
+  PUT(h->heap_listp + (2 * WSIZE), PACK(DSIZE, 1)); // Prologue footer
+  PUT(h->heap_listp + (3 * WSIZE), PACK(0, 1) | PREV_ALLOC); // Epilogue header 
+  h->heap_listp += (2 * WSIZE); // Placed on prologue footer
 
   // Extend the empty heap with a free block of CHUNKSIZE bytes 
-  if ((first_freep = extend_heap(CHUNKSIZE / WSIZE)) == NULL)
+  if (extend_heap(h, CHUNKSIZE / WSIZE) == NULL)
     return -1;
 
-  set_next_fblkp(first_freep, NULL);
-  set_prev_fblkp(first_freep, NULL);
-
   return 0;
 }
 
@@ -116,61 +599,550 @@ int mm_init(void) {
  * mm_malloc - Allocate a block with at least size bytes of payload
  */
 void *mm_malloc(size_t size) {
+  mm_heap_t *h;
+  void *bp;
+
+#ifdef MM_THREADS
+  // Small requests are served from the cache of the thread
+  if (size > 0 && size <= TCACHE_MAX && MM_TCACHE_DEPTH > 0)
+    return tcache_alloc(size);
+#endif
+
+  if ((h = acquire_heap(NULL)) == NULL)
+    return NULL;
+  bp = mm_heap_malloc(h, size);
+  release_heap(h);
+
+  return bp;
+}
+
+/*
+ * mm_heap_malloc - mm_malloc in the heap h
+ */
+void *mm_heap_malloc(mm_heap_t *h, size_t size) {
+  // Ignore spurious requests, and those too large for a header
+  if (size == 0 || size > MAX_BLOCK - DSIZE)
+    return NULL;
+
+  // Small requests are served from a slab
+  if (size <= SLAB_MAX)
+    return slab_alloc(h, size);
+
+  return block_alloc(h, size, NULL, NULL);
+}
+
+/*
+ * block_alloc - Allocate a block of more than SLAB_MAX bytes in heap h, from a mapping if it's huge, or else the
+ * free block that fits, extending the heap if none does. If the heap is at its limit, it gets a mapping anyway.
+ * Unless lop is NULL, the payload from *lop up to *hip is set to the whole pages of its first size bytes known to
+ * read as zero, which are the pages of a mapping, or those of a CLEAN block past its age. Both are set to the end
+ * of the first size bytes if there are none
+ */
+static void *block_alloc(mm_heap_t *h, size_t size, char **lop, char **hip) {
+  size_t pagesize = mem_region_pagesize(h->region);
   size_t asize;      // Adjusted block size 
   size_t extendsize; // Amount to extend heap if no fit 
-  void *bp;
+  char *bp, *endp;
+
+  if (size <= h->huge_min) {
+    asize = get_alligned(size);
+    if ((bp = find_fit(h, asize)) == NULL) {
+      extendsize = MAX(asize, CHUNKSIZE);
+      bp = extend_heap(h, extendsize / WSIZE);
+    }
+    if (bp != NULL) {
+      if (lop != NULL) {
+        endp = bp + size;
+        *lop = *hip = endp;
+        if (GET(HDRP(bp)) & CLEAN) {
+          *lop = (char *)(((size_t)DIRTY_END(bp) + pagesize - 1) & ~(pagesize - 1));
+          *hip = (char *)((size_t)FTRP(bp) & ~(pagesize - 1));
+          if (*hip > endp)
+            *hip = endp;
+          if (*lop > *hip)
+            *lop = *hip = endp;
+        }
+      }
+      place(h, bp, asize);
+      return bp;
+    }
+  }
 
-  if (heap_listp == 0) {
-    mm_init();
+  // A huge block, or one the heap at its limit can't hold, gets a mapping of its own, which reads as zero
+  if ((bp = huge_alloc(h, size)) != NULL && lop != NULL) {
+    *lop = bp;
+    *hip = bp + size;
   }
 
-  // Ignore spurious requests 
-  if (size == 0)
+  return bp;
+}
+
+/*
+ * mm_memalign - Allocate a block with at least size bytes of payload, starting at a multiple of align,
+ * which must be a power of two
+ */
+void *mm_memalign(size_t align, size_t size) {
+  mm_heap_t *h;
+  void *bp;
+
+  if ((h = acquire_heap(NULL)) == NULL)
+    return NULL;
+  bp = mm_heap_memalign(h, align, size);
+  release_heap(h);
+
+  return bp;
+}
+
+/*
+ * mm_heap_memalign - mm_memalign in the heap h
+ */
+void *mm_heap_memalign(mm_heap_t *h, size_t align, size_t size) {
+  size_t asize;
+  void *bp;
+
+  if (align & (align - 1))
+    return NULL;
+  // Every block is aligned to DSIZE already
+  if (align <= DSIZE)
+    return mm_heap_malloc(h, size);
+  // The block must fit in a header, with the most padding that may come before it
+  if (size == 0 || size > MAX_BLOCK || align > MAX_BLOCK || size + align + 3 * DSIZE > MAX_BLOCK)
     return NULL;
+  // The payload of a huge block can be put at any offset within the first page of its mapping
+  if (size > h->huge_min && align <= mem_pagesize())
+    return huge_memalign(h, align, size);
 
+  // Slots don't follow any alignment but their size, so the block comes from the heap, however small.
+  // A free block large enough to hold a leading fragment before the aligned payload is split in 2
   asize = get_alligned(size);
-  if ((bp = find_fit(asize)) == NULL) {
+  if ((bp = find_aligned_fit(h, asize, align, 0)) == NULL &&
+      (bp = extend_heap_aligned(h, asize, align, 0)) == NULL)
+    return align <= mem_pagesize() ? huge_memalign(h, align, size) : NULL;
 
-    extendsize = MAX(asize, CHUNKSIZE);
-    if ((bp = extend_heap(extendsize / WSIZE)) == NULL)
-      return NULL;
+  return place_aligned(h, bp, asize, align, 0);
+}
+
+/*
+ * mm_calloc - Allocate a zeroed block for nmemb elements of size bytes each
+ */
+void *mm_calloc(size_t nmemb, size_t size) {
+  mm_heap_t *h;
+  void *bp;
+
+#ifdef MM_THREADS
+  // Small requests are served from the cache of the thread, where blocks are never known to be zero
+  if (nmemb > 0 && size > 0 && size <= TCACHE_MAX / nmemb && MM_TCACHE_DEPTH > 0) {
+    if ((bp = tcache_alloc(nmemb * size)) != NULL)
+      memset(bp, 0, nmemb * size);
+    return bp;
+  }
+#endif
+
+  if ((h = acquire_heap(NULL)) == NULL)
+    return NULL;
+  bp = mm_heap_calloc(h, nmemb, size);
+  release_heap(h);
+
+  return bp;
+}
+
+/*
+ * mm_heap_calloc - mm_calloc in the heap h. Of a CLEAN block only the payload outside its whole pages is zeroed
+ */
+void *mm_heap_calloc(mm_heap_t *h, size_t nmemb, size_t size) {
+  char *bp, *lo, *hi;
+
+  // Ignore spurious requests, and those too large for a header
+  if (nmemb == 0 || size == 0 || size > (MAX_BLOCK - DSIZE) / nmemb)
+    return NULL;
+  size *= nmemb;
+
+  // Slots are reused, so they're always cleared
+  if (size <= SLAB_MAX) {
+    if ((bp = slab_alloc(h, size)) != NULL)
+      memset(bp, 0, size);
+    return bp;
   }
 
-  // No fit found. Get more memory and place the block 
-  place(bp, asize);
+  // Only the payload outside the pages known to read as zero is cleared
+  if ((bp = block_alloc(h, size, &lo, &hi)) != NULL) {
+    memset(bp, 0, lo - bp);
+    memset(hi, 0, bp + size - hi);
+  }
 
   return bp;
 }
 
+/*
+ * mm_malloc_batch - Allocate n blocks with at least size bytes of payload each into ptrs, under a single lock.
+ * Returns the number of blocks allocated, which is less than n if out of memory
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs) {
+  mm_heap_t *h;
+  size_t count;
+
+  if ((h = acquire_heap(NULL)) == NULL)
+    return 0;
+  count = mm_heap_malloc_batch(h, size, n, ptrs);
+  release_heap(h);
+
+  return count;
+}
+
+/*
+ * mm_heap_malloc_batch - mm_malloc_batch in the heap h. The blocks are carved in address order
+ * from a single fit for all of them, so the lists are searched and updated once for the batch
+ */
+size_t mm_heap_malloc_batch(mm_heap_t *h, size_t size, size_t n, void **ptrs) {
+  size_t asize, csize, k;
+  size_t i = 0;
+  char *bp;
+
+  // Ignore spurious requests, and those too large for a header
+  if (size == 0 || size > MAX_BLOCK - DSIZE)
+    return 0;
+
+  // Slots and huge blocks aren't carved from free blocks, so they're allocated one at a time
+  if (size <= SLAB_MAX || size > h->huge_min) {
+    while (i < n && (ptrs[i] = mm_heap_malloc(h, size)) != NULL)
+      i++;
+    return i;
+  }
+
+  asize = get_alligned(size);
+  while (i < n) {
+    // A fit is no larger than the heap serves, and is halved for as long as the heap can't grow by it
+    k = MIN(n - i, MAX(h->huge_min / asize, 1));
+    while ((bp = find_fit(h, k * asize)) == NULL &&
+           (bp = extend_heap(h, MAX(k * asize, CHUNKSIZE) / WSIZE)) == NULL) {
+      if (k == 1) {
+        // The heap is at its limit, so the rest get mappings of their own
+        while (i < n && (ptrs[i] = huge_alloc(h, size)) != NULL)
+          i++;
+        return i;
+      }
+      k /= 2;
+    }
+    place(h, bp, k * asize);
+
+    // Split the allocated block, leaving any excess place didn't split off with the last one
+    for (csize = GET_SIZE(HDRP(bp)); k > 1; k--, csize -= asize) {
+      PUT(HDRP(bp), PACK(asize, 1) | GET_PREV_ALLOC(HDRP(bp)));
+      ptrs[i++] = bp;
+      bp = NEXT_BLKP(bp);
+      PUT(HDRP(bp), PACK(csize - asize, 1) | PREV_ALLOC);
+    }
+    ptrs[i++] = bp;
+  }
+
+  return i;
+}
+
 /*
  * mm_free - Free a block
  */
 void mm_free(void *bp) {
+#ifdef MM_THREADS
+  if (bp != NULL && MM_TCACHE_DEPTH > 0 && tcache_free(bp))
+    return;
+#endif
+
+  arena_free(bp);
+}
+
+/*
+ * arena_free - Free a block into the heap it came from, past the caches
+ */
+static void arena_free(void *bp) {
+  mm_heap_t *h;
+
+#ifdef MM_THREADS
+  // Blocks of other arenas are handed to their owner, rather than waiting for its lock
+  if (bp != NULL && (h = find_arena(bp)) != NULL && h != thread_heapp) {
+    remote_free(h, bp);
+    return;
+  }
+#endif
+
+  if ((h = acquire_heap(bp)) == NULL)
+    return;
+  mm_heap_free(h, bp);
+  release_heap(h);
+}
+
+/*
+ * mm_heap_free - Free a block of the heap h
+ */
+void mm_heap_free(mm_heap_t *h, void *bp) {
+  size_t size;
+
   // Cannot free the prologue block / alignment block which 0 points to
   if (bp == 0)
     return;
+  h->frees++; // The clock the dirty list ages by
+
+  if (is_huge(h, bp)) {
+    // A block of this size was short-lived, so the next ones are served from the heap, without mapping them,
+    // unless a few of them would fill it
+    size = HUGE_SIZE(bp);
+    if (size > h->huge_min && size <= MM_HUGE_THRESHOLD_MAX &&
+        size <= mem_region_max_size(h->region) / MM_HUGE_THRESHOLD_SHARE)
+      h->huge_min = size;
+    huge_free(h, bp);
+    return;
+  }
 
-  // If the heap hasn't been initialized do so and return
-  if (heap_listp == 0) {
-    mm_init();
+  // Slots in a slab have no header, the slab keeps track of them
+  if (is_slab(h, bp)) {
+    slab_free(h, bp);
     return;
   }
 
   // Get the size of the current block
-  size_t size = GET_SIZE(HDRP(bp));
-  // Unallocate the block
-  PUT(HDRP(bp), PACK(size, 0));
+  size = GET_SIZE(HDRP(bp));
+  // Unallocate the block, and give it the footer it didn't have while allocated
+  PUT(HDRP(bp), PACK(size, 0) | GET_PREV_ALLOC(HDRP(bp)));
   PUT(FTRP(bp), PACK(size, 0));
   // Merge with sorrounding blocks
-  coalesce(bp);
+  bp = coalesce(h, bp);
+
+  // Give a large free block at the end of the heap back, keeping the top pad for the next extensions.
+  // The pad decays while the heap doesn't grow back
+  if (h->top_pad > MM_TOP_PAD && h->frees - h->pad_frees >= MM_TOP_PAD_DECAY) {
+    h->top_pad = MAX(h->top_pad / 2, MM_TOP_PAD);
+    h->pad_frees = h->frees;
+  }
+  if (MM_TRIM_THRESHOLD > 0 && GET_SIZE(HDRP(bp)) > h->top_pad + MM_TRIM_THRESHOLD &&
+      GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0)
+    trim_top(h, bp);
+  // Drop the pages of the large free blocks once enough of them are dirty
+  if (MM_PURGE_THRESHOLD > 0 && h->dirty_size > MM_PURGE_THRESHOLD)
+    purge_dirty(h, MM_PURGE_AGE);
+}
+
+/*
+ * mm_free_batch - Free the n blocks in ptrs, which is sorted by address in place
+ * In thread-safe builds the blocks of each arena are freed under a single lock, past the caches
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+  mm_heap_t *h;
+#ifdef MM_THREADS
+  size_t i, j, k;
+#endif
+
+  qsort(ptrs, n, sizeof(void *), ptr_cmp);
+#ifdef MM_THREADS
+  // The regions of the arenas don't overlap, so the blocks of an arena follow each other once sorted.
+  // A huge block is in no region, and is freed on its own
+  for (i = 0; i < n; i = j) {
+    h = ptrs[i] != NULL ? find_arena(ptrs[i]) : NULL;
+    for (j = i + 1; j < n && h != NULL && owns_block(h, ptrs[j]); j++)
+      ;
+    // Runs of other arenas are handed to their owner, like single blocks, rather than waiting for its lock
+    if (h != NULL && h != thread_heapp) {
+      for (k = i; k < j; k++)
+        remote_free(h, ptrs[k]);
+      continue;
+    }
+    if (ptrs[i] == NULL || (h = acquire_heap(ptrs[i])) == NULL)
+      continue;
+    free_sorted(h, ptrs + i, j - i);
+    release_heap(h);
+  }
+#else
+  if ((h = acquire_heap(NULL)) == NULL)
+    return;
+  free_sorted(h, ptrs, n);
+  release_heap(h);
+#endif
+}
+
+/*
+ * mm_heap_free_batch - mm_free_batch of blocks of the heap h
+ */
+void mm_heap_free_batch(mm_heap_t *h, void **ptrs, size_t n) {
+  qsort(ptrs, n, sizeof(void *), ptr_cmp);
+  free_sorted(h, ptrs, n);
+}
+
+/*
+ * free_sorted - Free the n blocks of heap h in ptrs, sorted by address. Blocks next to each other are
+ * joined before freeing, so each run of them is coalesced and put in the lists once
+ */
+static void free_sorted(mm_heap_t *h, void **ptrs, size_t n) {
+  size_t i, size;
+  char *bp;
+
+  for (i = 0; i < n; i++) {
+    bp = ptrs[i];
+    if (bp == NULL || is_huge(h, bp) || is_slab(h, bp)) {
+      mm_heap_free(h, bp);
+      continue;
+    }
+
+    // No slot starts where a block does, so the blocks following bp are the ones with its next payloads
+    size = GET_SIZE(HDRP(bp));
+    while (i + 1 < n && ptrs[i + 1] == bp + size)
+      size += GET_SIZE(HDRP(ptrs[++i]));
+    PUT(HDRP(bp), PACK(size, 1) | GET_PREV_ALLOC(HDRP(bp)));
+    mm_heap_free(h, bp);
+  }
+}
+
+/*
+ * ptr_cmp - Order pointers by address, for qsort
+ */
+static int ptr_cmp(const void *a, const void *b) {
+  char *p = *(char **)a, *q = *(char **)b;
+
+  return (p > q) - (p < q);
+}
+
+/*
+ * trim_top - Trim the heap h from free, where bp is the free block at its end. The pages the heap has grown back into
+ * since free last trimmed it would better have been kept, so the top pad is raised by as much first
+ */
+static void trim_top(mm_heap_t *h, void *bp) {
+  char *brkp = (char *)mem_region_hi(h->region) + 1;
+
+  if (h->trim_brkp != NULL && brkp > h->trim_brkp) {
+    h->top_pad = MIN(h->top_pad + (brkp - h->trim_brkp), MM_TOP_PAD_MAX);
+    h->pad_frees = h->frees;
+  }
+  if (GET_SIZE(HDRP(bp)) > h->top_pad + MM_TRIM_THRESHOLD)
+    mm_heap_trim(h, h->top_pad);
+  h->trim_brkp = (char *)mem_region_hi(h->region) + 1;
+}
+
+/*
+ * mm_trim - Give the free memory at the end of the heap back to memlib, keeping pad bytes of it.
+ * In thread-safe builds every arena is trimmed. Returns 1 if any memory was given back
+ */
+int mm_trim(size_t pad) {
+  mm_heap_t *h;
+  int trimmed = 0;
+
+#ifdef MM_THREADS
+  int i;
+
+  // Blocks other threads have freed into an arena are taken back first, as they may be at the end
+  for (i = 0; i < MM_ARENAS; i++) {
+    if ((h = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE)) == NULL)
+      continue;
+    pthread_mutex_lock(&h->lock);
+    drain_remote(h);
+    trimmed |= mm_heap_trim(h, pad);
+    pthread_mutex_unlock(&h->lock);
+  }
+#else
+  if ((h = acquire_heap(NULL)) == NULL)
+    return 0;
+  trimmed = mm_heap_trim(h, pad);
+  release_heap(h);
+#endif
+
+  return trimmed;
+}
+
+/*
+ * mm_heap_trim - mm_trim of the heap h. The heap is shrunk by whole pages of its region, ending at a page boundary
+ */
+int mm_heap_trim(mm_heap_t *h, size_t pad) {
+  char *endp = (char *)mem_region_hi(h->region) + 1; // The epilogue
+  size_t size, newsize, pagesize;
+  char *bp;
+
+  if (GET_PREV_ALLOC(HDRP(endp)))
+    return 0;
+
+  // The last block keeps at least pad bytes, and room for a free block
+  bp = PREV_BLKP(endp);
+  size = GET_SIZE(HDRP(bp));
+  pagesize = mem_region_pagesize(h->region);
+  newsize = (((size_t)bp + MAX(pad, 2 * DSIZE) + pagesize - 1) & ~(pagesize - 1)) - (size_t)bp;
+  if (newsize >= size)
+    return 0;
+
+  remove_from_empty_list(h, bp);
+  PUT(HDRP(bp), PACK(newsize, 0) | (GET(HDRP(bp)) & (PREV_ALLOC | CLEAN)));
+  PUT(FTRP(bp), PACK(newsize, 0));
+  PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); // New epilogue header, after a free block
+  insert_in_empty_list(h, bp);
+  mem_region_sbrk(h->region, -(intptr_t)(size - newsize));
+
+  return 1;
+}
+
+/*
+ * mm_purge - Drop the whole pages inside large free blocks, which stay free but no longer take up memory.
+ * In thread-safe builds every arena is purged. Returns the number of bytes dropped
+ */
+size_t mm_purge(void) {
+  mm_heap_t *h;
+  size_t purged = 0;
+
+#ifdef MM_THREADS
+  int i;
+
+  for (i = 0; i < MM_ARENAS; i++) {
+    if ((h = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE)) == NULL)
+      continue;
+    pthread_mutex_lock(&h->lock);
+    drain_remote(h);
+    purged += mm_heap_purge(h);
+    pthread_mutex_unlock(&h->lock);
+  }
+#else
+  if ((h = acquire_heap(NULL)) == NULL)
+    return 0;
+  purged = mm_heap_purge(h);
+  release_heap(h);
+#endif
+
+  return purged;
+}
+
+/*
+ * mm_heap_purge - mm_purge of the heap h. Every block in the dirty list has the pages between its age and footer
+ * dropped, and is marked CLEAN until it's merged
+ */
+size_t mm_heap_purge(mm_heap_t *h) {
+  return purge_dirty(h, 0);
+}
+
+/*
+ * purge_dirty - Purge the blocks in the dirty list of heap h that have been in it for at least age frees.
+ * The list is in the order the blocks joined it, so the first one too young ends it. Returns the number of bytes dropped
+ */
+static size_t purge_dirty(mm_heap_t *h, unsigned int age) {
+  size_t pagesize = mem_region_pagesize(h->region);
+  size_t purged = 0, lo, hi;
+  char *bp;
+
+  while ((bp = h->dirty_headp) != NULL && h->frees - GET(DIRTY_AGEP(bp)) >= age) {
+    // A block whose pages can't be dropped is left dirty but out of the list, rather than tried again on every free
+    dirty_unlink(h, bp);
+    // Only whole pages of the region, so huge pages aren't split
+    lo = ((size_t)DIRTY_END(bp) + pagesize - 1) & ~(pagesize - 1);
+    hi = (size_t)FTRP(bp) & ~(pagesize - 1);
+    if (lo < hi) {
+      if (mem_purge((void *)lo, hi - lo) < hi - lo)
+        continue;
+      purged += hi - lo;
+    }
+    PUT(HDRP(bp), GET(HDRP(bp)) | CLEAN);
+  }
+
+  return purged;
 }
 
 /*
  * coalesce - Boundary tag coalescing. Return ptr to coalesced block
+ * Also marks the block after the coalesced block as having a free previous block.
  */
-static void *coalesce(void *bp) {
+static void *coalesce(mm_heap_t *h, void *bp) {
   // Is the previous block allocated
-  size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+  size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
   // Is the next block allocated?
   size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
   // Get the size of the current block
@@ -178,7 +1150,8 @@ static void *coalesce(void *bp) {
 
   // Sandwiched between 2 allocated blocks
   if (prev_alloc && next_alloc) {
-    insert_in_empty_list(bp);
+    insert_in_empty_list(h, bp);
+    CLEAR_NEXT_PREV_ALLOC(bp);
     return bp;
   }
   
@@ -187,9 +1160,9 @@ static void *coalesce(void *bp) {
     // Get the combined size of the current and next block
     size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
     // Remove from empty list
-    remove_from_empty_list(NEXT_BLKP(bp));
+    remove_from_empty_list(h, NEXT_BLKP(bp));
     // Overwrite the current block size
-    PUT(HDRP(bp), PACK(size, 0));
+    PUT(HDRP(bp), PACK(size, 0) | prev_alloc);
     PUT(FTRP(bp), PACK(size, 0));
   }
 
@@ -198,10 +1171,10 @@ static void *coalesce(void *bp) {
     // Get the combined size of the current and next block
     size += GET_SIZE(HDRP(PREV_BLKP(bp)));
     // Remove from empty list
-    remove_from_empty_list(PREV_BLKP(bp));
+    remove_from_empty_list(h, PREV_BLKP(bp));
     // Overwrite the header of the previous block
     PUT(FTRP(bp), PACK(size, 0));
-    PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+    PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) | GET_PREV_ALLOC(HDRP(PREV_BLKP(bp))));
     // Return the bp of previous blocks original position
     bp = PREV_BLKP(bp);
   } 
@@ -211,240 +1184,1510 @@ static void *coalesce(void *bp) {
     // Get the full size
     size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp)));
     // Remove from empty list
-    remove_from_empty_list(NEXT_BLKP(bp));
-    remove_from_empty_list(PREV_BLKP(bp));
+    remove_from_empty_list(h, NEXT_BLKP(bp));
+    remove_from_empty_list(h, PREV_BLKP(bp));
     // Overwrite the header of the previous block
-    PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+    PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) | GET_PREV_ALLOC(HDRP(PREV_BLKP(bp))));
     // Overwrite the footer of the next block
     PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
     // Return the bp of previous blocks original position
     bp = PREV_BLKP(bp);
   }
-  insert_in_empty_list(bp);
+  insert_in_empty_list(h, bp);
+  CLEAR_NEXT_PREV_ALLOC(bp);
 
   // No change so return the current block
   return bp;
 }
 
+/*
+ * mm_realloc - Resize a block, moving it if it cannot grow in place
+ */
 void *mm_realloc(void *ptr, size_t size) {
+  mm_heap_t *h;
   void *newptr;
-  size_t oldsize, asize, next_alloc, next_size;
 
-  if (size == 0) {
-    mm_free(ptr);
+  // The block stays in the heap it came from
+  if ((h = acquire_heap(ptr)) == NULL)
     return NULL;
-  }
+  newptr = mm_heap_realloc(h, ptr, size);
+  release_heap(h);
 
-  if (ptr == NULL) {
-    return mm_malloc(size);
-  }
+  return newptr;
+}
 
-  oldsize = GET_SIZE(HDRP(ptr));
-  asize = get_alligned(size);
-  next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(ptr)));
-  next_size = GET_SIZE(HDRP(NEXT_BLKP(ptr)));
+/*
+ * mm_usable_size - Get the number of bytes of the payload of a block, which may be more than was asked for
+ */
+size_t mm_usable_size(void *ptr) {
+  mm_heap_t *h;
+  size_t size;
 
-  if (asize == size) {
-    return ptr;
-  } else if (asize < oldsize) {
-    // Smaller than current, cannot be shrunk
-    // Smaller than current, can be shrunk and split
-    return ptr;
-  } else if (!next_alloc && ((next_size + oldsize) - 2 * DSIZE) >= asize) {
-    // TODO: Why is 2*dsize necessary above? Check for possible cases where that impacts utility
-    // Larger than current, next is last of heap, large enough, just not to split
-    // Larger than current, next is last of heap, large enough, with split
-    // Larger than current, next is free and large enough, just not to split
-    // Larger than current, next is free and large enough, with split
-    remove_from_empty_list(NEXT_BLKP(ptr));
-
-    PUT(HDRP(ptr), PACK(next_size + oldsize, 1));
-    PUT(FTRP(ptr), PACK(next_size + oldsize, 1));
-    return ptr;
-  } else {
-    // TODO: Check that this actually uses the last block in case of expanding
-    // Larger than current, next is not free, heap is small
-    // Larger than current, next is not free, heap is large
-    // Larger than current, next is free, but too small
-    // Larger than current, next is last of heap, but too small
-    // Larger than current, right next to end of heap
-    if ((newptr = mm_malloc(asize)) == NULL)
-      return NULL;
+  if (ptr == NULL || (h = acquire_heap(ptr)) == NULL)
+    return 0;
+  size = mm_heap_usable_size(h, ptr);
+  release_heap(h);
 
-    place(newptr, asize);
-    memcpy(newptr, ptr, oldsize);
+  return size;
+}
 
-    mm_free(ptr);
+/*
+ * mm_expand - Grow a block in place to at least min and at most max bytes of payload, taking as much as there is room
+ * for. Returns the usable size of the block, or 0 if it can't hold min bytes without moving, leaving it as it was
+ */
+size_t mm_expand(void *ptr, size_t min, size_t max) {
+  mm_heap_t *h;
+  size_t size;
 
-    return newptr;
-  }
+  if (ptr == NULL || (h = acquire_heap(ptr)) == NULL)
+    return 0;
+  size = mm_heap_expand(h, ptr, min, max);
+  release_heap(h);
 
-  return ptr;
+  return size;
 }
 
-static void set_next_fblkp(void *bp, void *next) {
-  if (bp == NULL) return;
+/*
+ * mm_arena_create - Create an arena taking chunks of at least chunk bytes from the default heap.
+ * Returns NULL if out of memory
+ */
+mm_arena_t *mm_arena_create(size_t chunk) {
+  mm_arena_t *a;
 
-  PUT(NEXT_FBLKP(bp), next);
-}
+  if ((a = mm_malloc(sizeof(mm_arena_t))) == NULL)
+    return NULL;
+  a->chunk_size = chunk;
+  a->chunkp = NULL;
+  a->topp = NULL;
 
-static void set_prev_fblkp(void *bp, void *prev) {
-  if (bp == NULL) return;
+  return a;
+}
 
-  PUT(PREV_FBLKP(bp), prev);
+/*
+ * mm_arena_destroy - Give every chunk of arena a back to the heap, and free the arena
+ */
+void mm_arena_destroy(mm_arena_t *a) {
+  mm_arena_release(a, NULL);
+  mm_free(a);
 }
 
 /*
- * insert_in_empty_list - Insert free block in the list
- * We go by LIFO, so the inserted block shall have no previous node. Whilst we overwrite the previous of the last root block. Then we set our next to the previous root block and set the root to us.
+ * mm_arena_alloc - Allocate size bytes from arena a, by bumping the top of its last chunk. A chunk too full for the
+ * request is grown in place if it can be, and otherwise a new one is taken. Returns NULL if out of memory
  */
-static void insert_in_empty_list(void *bp) {
-  set_prev_fblkp(first_freep, bp);
-  set_next_fblkp(bp, first_freep);
-  set_prev_fblkp(bp, NULL);
+void *mm_arena_alloc(mm_arena_t *a, size_t size) {
+  arena_chunk_t *cp = a->chunkp;
+  size_t asize, usable;
+  char *bp;
+
+  if (size == 0 || size > MAX_BLOCK - 2 * DSIZE - ARENA_HDR)
+    return NULL;
+  asize = (size + DSIZE - 1) & ~(DSIZE - 1);
+
+  if (cp == NULL || asize > (size_t)(cp->endp - a->topp)) {
+    // At the end of the heap, the chunk grows by another chunk instead of leaving its rest unused
+    if (cp != NULL &&
+        (usable = mm_expand(cp, a->topp + asize - (char *)cp, a->topp + asize + a->chunk_size - (char *)cp)) > 0) {
+      cp->endp = (char *)cp + usable;
+    } else {
+      if ((cp = mm_malloc(MAX(a->chunk_size, ARENA_HDR + asize))) == NULL)
+        return NULL;
+      cp->prevp = a->chunkp;
+      cp->endp = (char *)cp + mm_usable_size(cp);
+      a->chunkp = cp;
+      a->topp = ARENA_START(cp);
+    }
+  }
+
+  bp = a->topp;
+  a->topp += asize;
 
-  first_freep = bp;
+  return bp;
 }
 
-static void remove_from_empty_list(void *bp) {
-  void *prevp = PREV_FBLK(bp);
-  void *nextp = NEXT_FBLK(bp);
+/*
+ * mm_arena_mark - Get the top of arena a, for mm_arena_release to roll back to
+ */
+void *mm_arena_mark(mm_arena_t *a) {
+  return a->topp;
+}
 
-  if (prevp == NULL) {
-    set_prev_fblkp(nextp, NULL);
-    first_freep = nextp;
-  } else {
-    set_next_fblkp(prevp, nextp);
+/*
+ * mm_arena_release - Free everything allocated from arena a since mark was taken, giving the chunks taken since back
+ * to the heap. Marks are released in the reverse order they were taken. A NULL mark releases every chunk
+ */
+void mm_arena_release(mm_arena_t *a, void *mark) {
+  arena_chunk_t *cp;
 
-    if (nextp != NULL)
-      set_prev_fblkp(nextp, prevp);
+  // The chunks taken after the mark are the ones it isn't in
+  while ((cp = a->chunkp) != NULL && ((char *)mark < ARENA_START(cp) || (char *)mark > cp->endp)) {
+    a->chunkp = cp->prevp;
+    mm_free(cp);
   }
-
-  set_next_fblkp(bp, 0);
-  set_prev_fblkp(bp, 0);
+  a->topp = cp != NULL ? mark : NULL;
 }
 
 /*
- * place - Place block of asize bytes at start of free block bp
- *         and split if remainder would be at least minimum block size
+ * mm_arena_reset - Free everything allocated from arena a, keeping its first chunk to allocate from again
  */
-static void place(void *bp, size_t asize)
-{
-  // Get the size of the block
-  size_t csize = GET_SIZE(HDRP(bp));
+void mm_arena_reset(mm_arena_t *a) {
+  arena_chunk_t *cp;
 
-  remove_from_empty_list(bp);
-  // Split if there is space for another block, and its headers after our data
+  if (a->chunkp == NULL)
+    return;
+  while ((cp = a->chunkp)->prevp != NULL) {
+    a->chunkp = cp->prevp;
+    mm_free(cp);
+  }
+  a->topp = ARENA_START(cp);
+}
+
+/*
+ * acquire_heap - Get the heap block bp belongs to, or the heap to allocate from if bp is NULL
+ * In thread-safe builds, every thread allocates from its own arena, and the heap is returned locked.
+ * Returns NULL if the arena can't be created
+ */
+static mm_heap_t *acquire_heap(void *bp) {
+#ifdef MM_THREADS
+  mm_heap_t *h;
+
+  if (bp == NULL)
+    h = thread_heapp != NULL ? thread_heapp : thread_init();
+  else if ((h = find_arena(bp)) == NULL)
+    h = HUGE_BLK(bp)->heap; // A huge block is in no region, but knows the arena it belongs to
+
+  if (h != NULL)
+    pthread_mutex_lock(&h->lock);
+  // Blocks freed by other threads are taken back before allocating
+  if (h != NULL && bp == NULL)
+    drain_remote(h);
+  return h;
+#else
+  if (default_heap.heap_listp == 0)
+    mm_init();
+  return &default_heap;
+#endif
+}
+
+/*
+ * release_heap - Unlock a heap returned by acquire_heap
+ */
+static void release_heap(mm_heap_t *h) {
+#ifdef MM_THREADS
+  pthread_mutex_unlock(&h->lock);
+#endif
+}
+
+#ifdef MM_THREADS
+/*
+ * owns_block - Check whether bp is in the region of heap h
+ */
+static int owns_block(mm_heap_t *h, void *bp) {
+  // The heap starts at the start of its region
+  return (char *)bp >= h->heap_basep && (char *)bp < h->heap_basep + MAX_RESERVE;
+}
+
+/*
+ * find_arena - Get the arena block bp belongs to, without locking it. Returns NULL if it's in no arena
+ * The regions of the arenas don't overlap, so the block belongs to the one whose region it's in
+ */
+static mm_heap_t *find_arena(void *bp) {
+  mm_heap_t *h;
+  int i;
+
+  for (i = 0; i < MM_ARENAS; i++) {
+    h = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+    if (h != NULL && owns_block(h, bp))
+      return h;
+  }
+
+  return NULL;
+}
+
+/*
+ * thread_init - Give the calling thread the next arena, creating it if no thread has had it yet.
+ * Returns the arena, or NULL if it can't be created
+ */
+static mm_heap_t *thread_init(void) {
+  int i = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % MM_ARENAS;
+
+  pthread_mutex_lock(&arenas_lock);
+  if (default_heap.heap_listp == 0 && mm_init() == -1)
+    i = -1;
+  if (i > 0 && arenas[i] == NULL)
+    __atomic_store_n(&arenas[i], mm_heap_create(), __ATOMIC_RELEASE);
+  thread_heapp = i < 0 ? NULL : arenas[i];
+  pthread_mutex_unlock(&arenas_lock);
+
+  // Have the cache of the thread flushed when it exits
+  pthread_once(&tcache_once, tcache_key_create);
+  pthread_setspecific(tcache_key, &tcache);
+#ifdef MM_RSEQ
+  // Use the caches of the CPUs instead, if the thread has an rseq area registered
+  pthread_once(&cpu_caches_once, cpu_caches_create);
+  thread_percpu = cpu_caches != NULL && (int)thread_rseq()->cpu_id >= 0;
+#endif
+
+  return thread_heapp;
+}
+
+/*
+ * remote_free - Push a block onto the remote free list of its arena h, without taking the lock
+ */
+static void remote_free(mm_heap_t *h, void *bp) {
+  char *nextp = __atomic_load_n(&h->remote_freep, __ATOMIC_RELAXED);
+
+  // A failed exchange loads the new head into nextp, so the link is written again before retrying
+  do {
+    *(char **)bp = nextp;
+  } while (!__atomic_compare_exchange_n(&h->remote_freep, &nextp, bp, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * drain_remote - Free the blocks on the remote free list of arena h, which must be locked
+ * The whole list is taken at once, so pushes racing with it simply start a new list
+ */
+static void drain_remote(mm_heap_t *h) {
+  char *bp, *nextp;
+
+  if (__atomic_load_n(&h->remote_freep, __ATOMIC_RELAXED) == NULL)
+    return;
+
+  for (bp = __atomic_exchange_n(&h->remote_freep, NULL, __ATOMIC_ACQUIRE); bp != NULL; bp = nextp) {
+    nextp = *(char **)bp;
+    mm_heap_free(h, bp);
+  }
+}
+
+/*
+ * tcache_alloc - Take a block of at least size bytes from the cache of the thread.
+ * If its bin is empty, it's refilled with a batch of blocks from the arena of the thread
+ */
+static void *tcache_alloc(size_t size) {
+  int bin = (size - 1) / DSIZE;
+  mm_heap_t *h;
+  char *bp;
+
+#ifdef MM_RSEQ
+  // The thread learns whether it uses the caches of the CPUs when it's given an arena
+  if (thread_heapp == NULL && thread_init() == NULL)
+    return NULL;
+  if (thread_percpu)
+    return percpu_alloc(size);
+#endif
+
+  if (tcache.binp[bin] == NULL) {
+    if ((h = acquire_heap(NULL)) == NULL)
+      return NULL;
+    // Allocate the largest size of the bin, so every block fits any request of it
+    while (tcache.count[bin] < TCACHE_BATCH && (bp = mm_heap_malloc(h, (bin + 1) * DSIZE)) != NULL) {
+      *(char **)bp = tcache.binp[bin];
+      tcache.binp[bin] = bp;
+      tcache.count[bin]++;
+    }
+    release_heap(h);
+    if (tcache.binp[bin] == NULL)
+      return NULL;
+  }
+
+  bp = tcache.binp[bin];
+  tcache.binp[bin] = *(char **)bp;
+  tcache.count[bin]--;
+
+  return bp;
+}
+
+/*
+ * tcache_free - Put a block in the cache of the thread. Returns 0 if the block isn't cached,
+ * because it's large or belongs to another arena. A full bin is flushed a batch at a time
+ */
+static int tcache_free(void *bp) {
+  mm_heap_t *h = thread_heapp;
+  int bin;
+
+#ifdef MM_RSEQ
+  if (thread_percpu)
+    return percpu_free(bp);
+#endif
+
+  if (h == NULL || !owns_block(h, bp) || (bin = cache_bin(h, bp)) < 0)
+    return 0;
+
+  *(char **)bp = tcache.binp[bin];
+  tcache.binp[bin] = bp;
+  if (++tcache.count[bin] > MM_TCACHE_DEPTH) {
+    acquire_heap(NULL);
+    tcache_flush(h, bin, TCACHE_BATCH);
+    release_heap(h);
+  }
+
+  return 1;
+}
+
+/*
+ * cache_bin - Get the cache bin of block bp of heap h, or -1 if it's too large to cache
+ * The bin goes by the payload of the block, rounded down to a multiple of DSIZE
+ */
+static int cache_bin(mm_heap_t *h, void *bp) {
+  size_t usable = is_slab(h, bp) ? GET(SLAB_SLOTP(SLAB_BASE(bp))) : GET_SIZE(HDRP(bp)) - WSIZE;
+  int bin = usable / DSIZE - 1;
+
+  return bin < TCACHE_BINS ? bin : -1;
+}
+
+/*
+ * tcache_flush - Free the first n blocks of a bin of the cache of the thread into its arena h, which must be locked
+ */
+static void tcache_flush(mm_heap_t *h, int bin, unsigned int n) {
+  char *bp;
+
+  while (n-- > 0 && (bp = tcache.binp[bin]) != NULL) {
+    tcache.binp[bin] = *(char **)bp;
+    tcache.count[bin]--;
+    mm_heap_free(h, bp);
+  }
+}
+
+/*
+ * tcache_key_create - Create the key that flushes the cache of a thread when it exits
+ */
+static void tcache_key_create(void) {
+  pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * tcache_destroy - Flush the whole cache of an exiting thread back to its arena
+ */
+static void tcache_destroy(void *arg) {
+  mm_heap_t *h = thread_heapp;
+  int bin;
+
+  acquire_heap(NULL);
+  for (bin = 0; bin < TCACHE_BINS; bin++)
+    tcache_flush(h, bin, tcache.count[bin]);
+  release_heap(h);
+}
+#endif
+
+#ifdef MM_RSEQ
+// Emit the descriptor of the rseq critical section from label 1 to the commit ending at label 2 as label 3,
+// with label 4 as the abort handler
+#define RSEQ_CS_DESCRIPTOR \
+  ".pushsection __rseq_cs, \"aw\"\n\t" \
+  ".balign 32\n\t" \
+  "3:\n\t" \
+  ".long 0, 0\n\t" \
+  ".quad 1f, (2f - 1f), 4f\n\t" \
+  ".popsection\n\t"
+
+// Emit the abort handler as label 4, which jumps to the failure path at label 5.
+// The kernel only jumps to a handler preceded by the signature registered with the rseq area
+#define RSEQ_ABORT_HANDLER \
+  ".pushsection __rseq_failure, \"ax\"\n\t" \
+  ".byte 0x0f, 0xb9, 0x3d\n\t" \
+  ".long " XSTR(RSEQ_SIG) "\n\t" \
+  "4:\n\t" \
+  "jmp 5f\n\t" \
+  ".popsection\n\t"
+
+/*
+ * cpu_caches_create - Allocate the caches of the CPUs, if glibc has registered an rseq area for the threads
+ */
+static void cpu_caches_create(void) {
+  long n = sysconf(_SC_NPROCESSORS_CONF);
+
+  if (__rseq_size == 0 || n <= 0)
+    return;
+  if ((cpu_caches = aligned_alloc(64, n * sizeof(cpu_cache_t))) == NULL)
+    return;
+  memset(cpu_caches, 0, n * sizeof(cpu_cache_t));
+  num_cpus = n;
+}
+
+/*
+ * thread_rseq - Get the rseq area of the calling thread
+ */
+static struct rseq *thread_rseq(void) {
+  return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/*
+ * percpu_pop - Pop a block from a bin of the cache of the current CPU.
+ * Returns NULL if the bin is empty, or the thread left the CPU before it was done
+ */
+static char *percpu_pop(int bin) {
+  struct rseq *rs = thread_rseq();
+  unsigned int cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+  cpu_cache_t *c;
+  char *bp;
+
+  if (cpu >= num_cpus)
+    return NULL;
+  c = &cpu_caches[cpu];
+
+  __asm__ __volatile__(
+    RSEQ_CS_DESCRIPTOR
+    "leaq 3b(%%rip), %%rax\n\t"
+    "movq %%rax, %[rseq_cs]\n\t"
+    "1:\n\t"
+    "cmpl %[cpu], %[cpu_id]\n\t"
+    "jnz 5f\n\t"
+    "movq %[count], %%rcx\n\t"
+    "testq %%rcx, %%rcx\n\t"
+    "jz 5f\n\t"
+    "movq -8(%[slots], %%rcx, 8), %[bp]\n\t"
+    "decq %%rcx\n\t"
+    "movq %%rcx, %[count]\n\t" // Commit
+    "2:\n\t"
+    "jmp 6f\n\t"
+    RSEQ_ABORT_HANDLER
+    "5:\n\t"
+    "xorl %k[bp], %k[bp]\n\t"
+    "6:\n\t"
+    : [bp] "=&r"(bp), [rseq_cs] "=m"(rs->rseq_cs), [count] "+m"(c->count[bin])
+    : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id), [slots] "r"(c->slotp[bin])
+    : "rax", "rcx", "memory", "cc");
+
+  return bp;
+}
+
+/*
+ * percpu_push - Push a block onto a bin of the cache of the current CPU.
+ * Returns 0 if the bin is full, or the thread left the CPU before it was done
+ */
+static int percpu_push(int bin, void *bp) {
+  struct rseq *rs = thread_rseq();
+  unsigned int cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+  cpu_cache_t *c;
+  int pushed;
+
+  if (cpu >= num_cpus)
+    return 0;
+  c = &cpu_caches[cpu];
+
+  __asm__ __volatile__(
+    RSEQ_CS_DESCRIPTOR
+    "leaq 3b(%%rip), %%rax\n\t"
+    "movq %%rax, %[rseq_cs]\n\t"
+    "1:\n\t"
+    "cmpl %[cpu], %[cpu_id]\n\t"
+    "jnz 5f\n\t"
+    "movq %[count], %%rcx\n\t"
+    "cmpq %[depth], %%rcx\n\t"
+    "jae 5f\n\t"
+    "movq %[bp], (%[slots], %%rcx, 8)\n\t"
+    "incq %%rcx\n\t"
+    "movq %%rcx, %[count]\n\t" // Commit
+    "2:\n\t"
+    "movl $1, %[pushed]\n\t"
+    "jmp 6f\n\t"
+    RSEQ_ABORT_HANDLER
+    "5:\n\t"
+    "movl $0, %[pushed]\n\t"
+    "6:\n\t"
+    : [pushed] "=&r"(pushed), [rseq_cs] "=m"(rs->rseq_cs), [count] "+m"(c->count[bin])
+    : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id), [slots] "r"(c->slotp[bin]), [bp] "r"(bp),
+      [depth] "i"(MM_TCACHE_DEPTH)
+    : "rax", "rcx", "memory", "cc");
+
+  return pushed;
+}
+
+/*
+ * percpu_alloc - Take a block of at least size bytes from the cache of the current CPU.
+ * If its bin is empty, a batch of blocks is allocated from the arena of the thread, and the rest of it is cached
+ */
+static void *percpu_alloc(size_t size) {
+  int bin = (size - 1) / DSIZE;
+  mm_heap_t *h;
+  char *bp, *p;
+  int i;
+
+  if ((bp = percpu_pop(bin)) != NULL)
+    return bp;
+
+  if ((h = acquire_heap(NULL)) == NULL)
+    return NULL;
+  // Allocate the largest size of the bin, so every block fits any request of it
+  bp = mm_heap_malloc(h, (bin + 1) * DSIZE);
+  for (i = 1; bp != NULL && i < TCACHE_BATCH; i++) {
+    if ((p = mm_heap_malloc(h, (bin + 1) * DSIZE)) == NULL)
+      break;
+    if (!percpu_push(bin, p)) {
+      mm_heap_free(h, p);
+      break;
+    }
+  }
+  release_heap(h);
+
+  return bp;
+}
+
+/*
+ * percpu_free - Push a block onto the cache of the current CPU. Returns 0 if the block isn't cached.
+ * A full bin is flushed a batch at a time, each block into its own arena
+ */
+static int percpu_free(void *bp) {
+  mm_heap_t *h;
+  char *p;
+  int bin, i;
+
+  if ((h = find_arena(bp)) == NULL || (bin = cache_bin(h, bp)) < 0)
+    return 0;
+  if (percpu_push(bin, bp))
+    return 1;
+
+  for (i = 0; i < TCACHE_BATCH && (p = percpu_pop(bin)) != NULL; i++)
+    arena_free(p);
+  return percpu_push(bin, bp);
+}
+#endif
+
+/*
+ * mm_heap_realloc - mm_realloc of a block in the heap h
+ */
+void *mm_heap_realloc(mm_heap_t *h, void *ptr, size_t size) {
+  void *newptr, *nextp;
+  size_t oldsize, asize, next_size, prev_size;
+
+  if (size == 0) {
+    mm_heap_free(h, ptr);
+    return NULL;
+  }
+
+  if (ptr == NULL) {
+    return mm_heap_malloc(h, size);
+  }
+
+  if (size > MAX_BLOCK - DSIZE)
+    return NULL;
+
+  // A huge block moves its pages, so it's never copied
+  if (is_huge(h, ptr))
+    return huge_realloc(h, ptr, size);
+
+  // A slot cannot grow, so move it unless it's large enough already
+  if (is_slab(h, ptr)) {
+    oldsize = GET(SLAB_SLOTP(SLAB_BASE(ptr)));
+    if (size <= oldsize)
+      return ptr;
+
+    if ((newptr = mm_heap_malloc(h, size)) == NULL)
+      return NULL;
+    memcpy(newptr, ptr, oldsize);
+    slab_free(h, ptr);
+
+    return newptr;
+  }
+
+  oldsize = GET_SIZE(HDRP(ptr));
+  asize = get_alligned(size);
+
+  if (asize <= oldsize) {
+    // Smaller than current. The tail is freed if it can be a block of its own, unless it's no more than the headroom
+    // a grown block was moved with
+    if (!(GET(HDRP(ptr)) & GROWN) || asize < oldsize - oldsize / 3)
+      shrink_block(h, ptr, asize);
+    return ptr;
+  }
+
+  // Larger than current. One growing past the huge threshold moves to a mapping of its own, so it's copied only once
+  if (size > h->huge_min) {
+    if ((newptr = huge_alloc(h, size)) == NULL)
+      return NULL;
+    memcpy(newptr, ptr, oldsize - WSIZE);
+    mm_heap_free(h, ptr);
+    return newptr;
+  }
+
+  // Grow in place into the free blocks around it if they're large enough
+  nextp = NEXT_BLKP(ptr);
+  next_size = GET_ALLOC(HDRP(nextp)) ? 0 : GET_SIZE(HDRP(nextp));
+  prev_size = GET_PREV_ALLOC(HDRP(ptr)) ? 0 : GET_SIZE(HDRP(ptr) - WSIZE);
+
+  if (oldsize + next_size < asize && prev_size + oldsize + next_size < asize) {
+    // The heap can be grown by what's missing, if the block, or the free block after it, is the last one.
+    // If it's at its limit, the block is moved
+    if (GET_SIZE(HDRP(next_size ? NEXT_BLKP(nextp) : nextp)) == 0 &&
+        extend_heap(h, MAX(asize - oldsize - next_size, 2 * DSIZE) / WSIZE) != NULL)
+      next_size = GET_SIZE(HDRP(nextp));
+  }
+
+  if (oldsize + next_size >= asize) {
+    // Take the free block after it, and split off what isn't needed
+    remove_from_empty_list(h, nextp);
+    PUT(HDRP(ptr), PACK(oldsize + next_size, 1) | GET_PREV_ALLOC(HDRP(ptr)));
+    SET_NEXT_PREV_ALLOC(ptr);
+    shrink_block(h, ptr, asize);
+    if (asize - oldsize < oldsize / 2)
+      PUT(HDRP(ptr), GET(HDRP(ptr)) | GROWN);
+    return ptr;
+  }
+
+  if (prev_size + oldsize + next_size >= asize) {
+    // Take the free block before it, and the one after it if it's free. The payload moves down to the new start
+    newptr = PREV_BLKP(ptr);
+    remove_from_empty_list(h, newptr);
+    if (next_size)
+      remove_from_empty_list(h, nextp);
+    PUT(HDRP(newptr), PACK(prev_size + oldsize + next_size, 1) | GET_PREV_ALLOC(HDRP(newptr)));
+    memmove(newptr, ptr, oldsize - WSIZE);
+    SET_NEXT_PREV_ALLOC(newptr);
+    shrink_block(h, newptr, asize);
+    if (asize - oldsize < oldsize / 2)
+      PUT(HDRP(newptr), GET(HDRP(newptr)) | GROWN);
+    return newptr;
+  }
+
+  // Nothing to grow into, so move the block. One that keeps growing by small steps goes to the end of the heap with
+  // headroom, so that the next grows only update its header, and the one after that can extend the heap.
+  // Without room for the headroom it's moved like any other
+  newptr = NULL;
+  if ((GET(HDRP(ptr)) & GROWN) && asize - oldsize < oldsize / 2) {
+    if (asize / 2 <= MAX_BLOCK - asize)
+      asize += asize / 2 & ~(DSIZE - 1);
+    if ((newptr = tail_fit(h, asize)) != NULL) {
+      place(h, newptr, asize);
+      PUT(HDRP(newptr), GET(HDRP(newptr)) | GROWN);
+    }
+  }
+  if (newptr == NULL && (newptr = mm_heap_malloc(h, size)) == NULL)
+    return NULL;
+
+  memcpy(newptr, ptr, oldsize - WSIZE); // Only copy the payload, not the header
+
+  mm_heap_free(h, ptr);
+
+  return newptr;
+}
+
+/*
+ * mm_heap_usable_size - mm_usable_size of a block in the heap h
+ */
+size_t mm_heap_usable_size(mm_heap_t *h, void *ptr) {
+  if (ptr == NULL)
+    return 0;
+  if (is_huge(h, ptr))
+    return HUGE_SIZE(ptr);
+  if (is_slab(h, ptr))
+    return GET(SLAB_SLOTP(SLAB_BASE(ptr)));
+
+  return GET_SIZE(HDRP(ptr)) - WSIZE;
+}
+
+/*
+ * mm_heap_expand - mm_expand of a block in the heap h. Unlike realloc, the block only grows into the free block
+ * after it, or the heap if it's the last one, as growing into the block before it would move the payload
+ */
+size_t mm_heap_expand(mm_heap_t *h, void *ptr, size_t min, size_t max) {
+  size_t usable, oldsize, asize, next_size;
+  void *nextp;
+
+  if (ptr == NULL)
+    return 0;
+  if ((usable = mm_heap_usable_size(h, ptr)) >= min)
+    return usable;
+  if (min > MAX_BLOCK - DSIZE)
+    return 0;
+  max = MIN(MAX(min, max), MAX_BLOCK - DSIZE);
+
+  // A huge block grows its mapping if the pages after it are free, and a slot can't grow at all
+  if (is_huge(h, ptr))
+    return huge_expand(h, ptr, max) == 0 || huge_expand(h, ptr, min) == 0 ? mm_heap_usable_size(h, ptr) : 0;
+  if (is_slab(h, ptr))
+    return 0;
+
+  oldsize = GET_SIZE(HDRP(ptr));
+  asize = get_alligned(min);
+  nextp = NEXT_BLKP(ptr);
+  next_size = GET_ALLOC(HDRP(nextp)) ? 0 : GET_SIZE(HDRP(nextp));
+
+  // The heap can be grown, if the block, or the free block after it, is the last one. It's grown by what's missing
+  // up to max, and by at least a chunk, so a block grown by small steps extends the heap only once in a while.
+  // Near the limit it's grown by what's missing up to min
+  if (oldsize + next_size < asize) {
+    if (GET_SIZE(HDRP(next_size ? NEXT_BLKP(nextp) : nextp)) != 0 ||
+        (extend_heap(h, MAX(get_alligned(max) - oldsize - next_size, CHUNKSIZE) / WSIZE) == NULL &&
+         extend_heap(h, MAX(asize - oldsize - next_size, 2 * DSIZE) / WSIZE) == NULL))
+      return 0;
+    next_size = GET_SIZE(HDRP(nextp));
+  }
+
+  // Take the free block after it, and split off what's past max
+  remove_from_empty_list(h, nextp);
+  PUT(HDRP(ptr), PACK(oldsize + next_size, 1) | GET_PREV_ALLOC(HDRP(ptr)));
+  SET_NEXT_PREV_ALLOC(ptr);
+  shrink_block(h, ptr, MIN(get_alligned(max), oldsize + next_size));
+
+  return GET_SIZE(HDRP(ptr)) - WSIZE;
+}
+
+static void set_next_fblkp(mm_heap_t *h, void *bp, void *next) {
+  if (bp == NULL) return;
+
+  PUT(NEXT_FBLKP(bp), TO_OFFSET(h, next));
+}
+
+static void set_prev_fblkp(mm_heap_t *h, void *bp, void *prev) {
+  if (bp == NULL) return;
+
+  PUT(PREV_FBLKP(bp), TO_OFFSET(h, prev));
+}
+
+/*
+ * insert_in_empty_list - Insert free block in the list of its size class, or the tree if it's large
+ * We go by LIFO, so the inserted block shall have no previous node. Whilst we overwrite the previous of the last root block. Then we set our next to the previous root block and set the root to us.
+ */
+static void insert_in_empty_list(mm_heap_t *h, void *bp) {
+  size_t size = GET_SIZE(HDRP(bp));
+
+  if (size > TREE_MIN) {
+    tree_insert(h, bp);
+    // The block at the end of the heap is left to trimming, which keeps the top pad of it
+    if (!(GET(HDRP(bp)) & CLEAN) && GET_SIZE(HDRP(NEXT_BLKP(bp))) > 0)
+      dirty_link(h, bp);
+    else
+      PUT(DIRTY_NEXTP(bp), DIRTY_NONE);
+  } else
+    link_block(h, &h->seg_listp[get_class(size)], bp);
+}
+
+/*
+ * remove_from_empty_list - Unlink a free block from the list of its size class, or the tree if it's large
+ * Must be called before the size in the header of the block is changed, as the size decides the list.
+ */
+static void remove_from_empty_list(mm_heap_t *h, void *bp) {
+  size_t size = GET_SIZE(HDRP(bp));
+
+  if (size > TREE_MIN) {
+    tree_remove(h, bp);
+    if (GET(DIRTY_NEXTP(bp)) != DIRTY_NONE)
+      dirty_unlink(h, bp);
+  } else
+    unlink_block(h, &h->seg_listp[get_class(size)], bp);
+}
+
+/*
+ * dirty_link - Append a block in the tree to the dirty list, behind the blocks that went dirty before it, and
+ * stamp it with the number of frees so far
+ */
+static void dirty_link(mm_heap_t *h, void *bp) {
+  PUT(DIRTY_NEXTP(bp), 0);
+  PUT(DIRTY_PREVP(bp), TO_OFFSET(h, h->dirty_tailp));
+  PUT(DIRTY_AGEP(bp), h->frees);
+  if (h->dirty_tailp != NULL)
+    PUT(DIRTY_NEXTP(h->dirty_tailp), TO_OFFSET(h, bp));
+  else
+    h->dirty_headp = bp;
+  h->dirty_tailp = bp;
+  h->dirty_size += GET_SIZE(HDRP(bp));
+}
+
+/*
+ * dirty_unlink - Take a block out of the dirty list, marking it as not in it
+ */
+static void dirty_unlink(mm_heap_t *h, void *bp) {
+  char *nextp = FROM_OFFSET(h, GET(DIRTY_NEXTP(bp)));
+  char *prevp = FROM_OFFSET(h, GET(DIRTY_PREVP(bp)));
+
+  if (prevp != NULL)
+    PUT(DIRTY_NEXTP(prevp), TO_OFFSET(h, nextp));
+  else
+    h->dirty_headp = nextp;
+  if (nextp != NULL)
+    PUT(DIRTY_PREVP(nextp), TO_OFFSET(h, prevp));
+  else
+    h->dirty_tailp = prevp;
+  PUT(DIRTY_NEXTP(bp), DIRTY_NONE);
+  h->dirty_size -= GET_SIZE(HDRP(bp));
+}
+
+/*
+ * link_block - Push a block onto the front of the list with the given root, using the next and prev pointers of the block
+ */
+static void link_block(mm_heap_t *h, char **rootp, void *bp) {
+  set_prev_fblkp(h, *rootp, bp);
+  set_next_fblkp(h, bp, *rootp);
+  set_prev_fblkp(h, bp, NULL);
+
+  *rootp = bp;
+}
+
+/*
+ * unlink_block - Remove a block from the list with the given root
+ */
+static void unlink_block(mm_heap_t *h, char **rootp, void *bp) {
+  void *prevp = PREV_FBLK(h, bp);
+  void *nextp = NEXT_FBLK(h, bp);
+
+  if (prevp == NULL) {
+    set_prev_fblkp(h, nextp, NULL);
+    *rootp = nextp;
+  } else {
+    set_next_fblkp(h, prevp, nextp);
+
+    if (nextp != NULL)
+      set_prev_fblkp(h, nextp, prevp);
+  }
+
+  set_next_fblkp(h, bp, 0);
+  set_prev_fblkp(h, bp, 0);
+}
+
+/*
+ * tree_cmp - Compare the key (size, addr) to the key of block bp in the tree
+ * Returns less than 0 if the key is smaller, 0 if it's bp, and more than 0 if it's larger
+ */
+static int tree_cmp(size_t size, void *addr, void *bp) {
+  size_t bsize = GET_SIZE(HDRP(bp));
+
+  if (size != bsize)
+    return size < bsize ? -1 : 1;
+  if (addr != bp)
+    return (char *)addr < (char *)bp ? -1 : 1;
+  return 0;
+}
+
+/*
+ * splay - Top-down splay of the tree rooted at t for the key (size, addr). Returns the new root
+ * The new root is the block with the key, or the block just before or after where the key would be.
+ * The nodes passed on the way down are collected in a left tree of smaller and a right tree of larger nodes,
+ * which are hung below the new root at the end.
+ */
+static char *splay(mm_heap_t *h, char *t, size_t size, void *addr) {
+  char *l_rootp = NULL, *l_tailp = NULL; // Left tree, and its node with the largest key
+  char *r_rootp = NULL, *r_tailp = NULL; // Right tree, and its node with the smallest key
+  char *yp;
+  int cmp;
+
+  while ((cmp = tree_cmp(size, addr, t)) != 0) {
+    if (cmp < 0) {
+      if (TREE_LEFT(h, t) == NULL)
+        break;
+      // Rotate right, if the key is left of the left child as well
+      if (tree_cmp(size, addr, TREE_LEFT(h, t)) < 0) {
+        yp = TREE_LEFT(h, t);
+        set_next_fblkp(h, t, TREE_RIGHT(h, yp));
+        set_prev_fblkp(h, yp, t);
+        t = yp;
+        if (TREE_LEFT(h, t) == NULL)
+          break;
+      }
+      // Link t into the right tree
+      if (r_tailp == NULL)
+        r_rootp = t;
+      else
+        set_next_fblkp(h, r_tailp, t);
+      r_tailp = t;
+      t = TREE_LEFT(h, t);
+    } else {
+      if (TREE_RIGHT(h, t) == NULL)
+        break;
+      // Rotate left, if the key is right of the right child as well
+      if (tree_cmp(size, addr, TREE_RIGHT(h, t)) > 0) {
+        yp = TREE_RIGHT(h, t);
+        set_prev_fblkp(h, t, TREE_LEFT(h, yp));
+        set_next_fblkp(h, yp, t);
+        t = yp;
+        if (TREE_RIGHT(h, t) == NULL)
+          break;
+      }
+      // Link t into the left tree
+      if (l_tailp == NULL)
+        l_rootp = t;
+      else
+        set_prev_fblkp(h, l_tailp, t);
+      l_tailp = t;
+      t = TREE_RIGHT(h, t);
+    }
+  }
+
+  // Reassemble, the children of t go to the tails of the side trees, which become the children of t
+  if (l_tailp != NULL) {
+    set_prev_fblkp(h, l_tailp, TREE_LEFT(h, t));
+    set_next_fblkp(h, t, l_rootp);
+  }
+  if (r_tailp != NULL) {
+    set_next_fblkp(h, r_tailp, TREE_RIGHT(h, t));
+    set_prev_fblkp(h, t, r_rootp);
+  }
+
+  return t;
+}
+
+/*
+ * tree_insert - Insert a free block into the tree, as the new root
+ */
+static void tree_insert(mm_heap_t *h, void *bp) {
+  size_t size = GET_SIZE(HDRP(bp));
+  char *t;
+
+  if (h->tree_rootp == NULL) {
+    set_next_fblkp(h, bp, NULL);
+    set_prev_fblkp(h, bp, NULL);
+    h->tree_rootp = bp;
+    return;
+  }
+
+  // Splay the neighbour of bp to the root, and split the tree around it
+  t = splay(h, h->tree_rootp, size, bp);
+  if (tree_cmp(size, bp, t) < 0) {
+    set_next_fblkp(h, bp, TREE_LEFT(h, t));
+    set_prev_fblkp(h, bp, t);
+    set_next_fblkp(h, t, NULL);
+  } else {
+    set_prev_fblkp(h, bp, TREE_RIGHT(h, t));
+    set_next_fblkp(h, bp, t);
+    set_prev_fblkp(h, t, NULL);
+  }
+  h->tree_rootp = bp;
+}
+
+/*
+ * tree_remove - Remove a free block from the tree
+ */
+static void tree_remove(mm_heap_t *h, void *bp) {
+  size_t size = GET_SIZE(HDRP(bp));
+  char *t = splay(h, h->tree_rootp, size, bp); // bp is in the tree, so it becomes the root
+
+  if (TREE_LEFT(h, t) == NULL) {
+    h->tree_rootp = TREE_RIGHT(h, t);
+  } else {
+    // Every node on the left is smaller than bp, so the largest one is splayed up, and has no right child
+    h->tree_rootp = splay(h, TREE_LEFT(h, t), size, bp);
+    set_prev_fblkp(h, h->tree_rootp, TREE_RIGHT(h, t));
+  }
+
+  set_next_fblkp(h, bp, 0);
+  set_prev_fblkp(h, bp, 0);
+}
+
+/*
+ * tree_best_fit - Find the smallest free block in the tree of at least asize bytes
+ * Only walks down the tree, as the block is splayed anyway once it's removed
+ */
+static void *tree_best_fit(mm_heap_t *h, size_t asize) {
+  char *t = h->tree_rootp;
+  char *bp = NULL;
+
+  while (t != NULL) {
+    if (GET_SIZE(HDRP(t)) >= asize) {
+      // t fits, but a smaller fit may be to the left
+      bp = t;
+      t = TREE_LEFT(h, t);
+    } else {
+      t = TREE_RIGHT(h, t);
+    }
+  }
+
+  return bp;
+}
+
+/*
+ * tree_aligned_fit - Find the smallest block of the subtree t that fits an aligned block of asize bytes,
+ * among the blocks smaller than limit. Doesn't splay, as it may pass many blocks that don't fit
+ */
+static void *tree_aligned_fit(mm_heap_t *h, char *t, size_t asize, size_t limit, size_t align, size_t skew) {
+  size_t size;
+  void *bp;
+
+  while (t != NULL) {
+    size = GET_SIZE(HDRP(t));
+    if (size < asize) {
+      t = TREE_RIGHT(h, t);
+    } else if (size >= limit) {
+      t = TREE_LEFT(h, t);
+    } else {
+      // Both t and blocks on either side are candidates, so try the smaller ones first
+      if ((bp = tree_aligned_fit(h, TREE_LEFT(h, t), asize, limit, align, skew)) != NULL)
+        return bp;
+      if (aligned_payload(t, align, skew) - t + asize <= size)
+        return t;
+      t = TREE_RIGHT(h, t);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * place - Place block of asize bytes at start of free block bp
+ *         and split if remainder would be at least minimum block size
+ */
+static void place(mm_heap_t *h, void *bp, size_t asize)
+{
+  // Get the size of the block
+  size_t csize = GET_SIZE(HDRP(bp));
+  size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+  size_t clean = GET(HDRP(bp)) & CLEAN;
+
+  remove_from_empty_list(h, bp);
+  // Split if there is space for another block, and its headers after our data
   if ((csize - asize) >= (2 * DSIZE)) {
     // Create the block for our data and allocate it
-    PUT(HDRP(bp), PACK(asize, 1));
-    PUT(FTRP(bp), PACK(asize, 1));
+    PUT(HDRP(bp), PACK(asize, 1) | prev_alloc);
     // Create pointer for the block after
     bp = NEXT_BLKP(bp);
-    // Create new free block
-    PUT(HDRP(bp), PACK(csize - asize, 0));
+    // Create new free block. Its whole pages were whole pages of the block split, so it's as clean
+    PUT(HDRP(bp), PACK(csize - asize, 0) | PREV_ALLOC | clean);
     PUT(FTRP(bp), PACK(csize - asize, 0));
 
-    coalesce(bp);
+    coalesce(h, bp);
   } else {
     // Set the block as allocated
-    PUT(HDRP(bp), PACK(csize, 1));
-    PUT(FTRP(bp), PACK(csize, 1));
+    PUT(HDRP(bp), PACK(csize, 1) | prev_alloc);
+    SET_NEXT_PREV_ALLOC(bp);
   }
 }
 
+/*
+ * tail_fit - Get a free block of at least asize bytes at the end of the heap, extending the heap by what the last
+ * block lacks
+ */
+static void *tail_fit(mm_heap_t *h, size_t asize) {
+  char *endp = (char *)mem_region_hi(h->region) + 1; // The epilogue
+  size_t last_size = GET_PREV_ALLOC(HDRP(endp)) ? 0 : GET_SIZE(HDRP(endp) - WSIZE);
+
+  if (last_size >= asize)
+    return PREV_BLKP(endp);
+
+  return extend_heap(h, MAX(asize - last_size, 2 * DSIZE) / WSIZE);
+}
+
+/*
+ * shrink_block - Shrink allocated block bp to asize bytes, if the rest is large enough to be a free block.
+ * The rest is coalesced with the block after it
+ */
+static void shrink_block(mm_heap_t *h, void *bp, size_t asize) {
+  size_t csize = GET_SIZE(HDRP(bp));
+
+  if (csize - asize < 2 * DSIZE)
+    return;
+
+  PUT(HDRP(bp), PACK(asize, 1) | GET_PREV_ALLOC(HDRP(bp)));
+  bp = NEXT_BLKP(bp);
+  PUT(HDRP(bp), PACK(csize - asize, 0) | PREV_ALLOC);
+  PUT(FTRP(bp), PACK(csize - asize, 0));
+
+  coalesce(h, bp);
+}
+
 /*
  * find_fit - Find a fit for a block with asize bytes
  */
-static void *find_fit(size_t asize)
+static void *find_fit(mm_heap_t *h, size_t asize)
 {
-  // First-fit search 
-  void *bp = first_freep;
+  int class = get_class(asize);
+  void *bp;
 
-  while (bp != NULL) {
+  // Large requests only fit in the tree
+  if (asize > TREE_MIN)
+    return tree_best_fit(h, asize);
+
+  // First-fit search in the class of the request, as it may contain smaller blocks
+  for (bp = h->seg_listp[class]; bp != NULL; bp = NEXT_FBLK(h, bp)) {
     if (GET_SIZE(HDRP(bp)) >= asize)
       return bp;
-    bp = NEXT_FBLK(bp);
   }
 
-  return NULL;
+  // Every block in a larger class is large enough, so take the first one found
+  for (class++; class < NUM_CLASSES; class++) {
+    if (h->seg_listp[class] != NULL)
+      return h->seg_listp[class];
+  }
+
+  // Every block in the tree is large enough as well, so take the smallest
+  return tree_best_fit(h, asize);
 }
 
 /*
  * extend_heap - Extend heap with free block and return its block pointer
  */
-static void *extend_heap(size_t words) {
+static void *extend_heap(mm_heap_t *h, size_t words) {
+  size_t pagesize = mem_region_pagesize(h->region);
+  size_t brk = (size_t)mem_region_hi(h->region) + 1;
+  // Memory the heap has never had reads as zero
+  size_t clean = (size_t)mem_region_zero(h->region) <= brk ? CLEAN : 0;
   char *bp;
-  size_t size;
+  size_t size, limit;
 
   // Allocate an even number of words to maintain alignment 
   size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-  if ((long)(bp = mem_sbrk(size)) == -1)
+  // A region backed by huge pages is grown to the end of a huge page, so the heap covers the pages it commits
+  if (pagesize > CHUNKSIZE)
+    size = ((brk + size + pagesize - 1) & ~(pagesize - 1)) - brk;
+  // A heap at its limit is a normal case, which the callers fall back from, so memlib isn't asked to grow past it
+  limit = mem_region_max_size(h->region);
+  if (mem_region_size(h->region) > limit || size > limit - mem_region_size(h->region))
+    return NULL;
+  if ((long)(bp = mem_region_sbrk(h->region, size)) == -1)
     return NULL;
 
   // Initialize free block header/footer and the epilogue header 
   // Overwrites old epilogue header, notice HDRP
-  PUT(HDRP(bp), PACK(size, 0));         // Free block header 
+  PUT(HDRP(bp), PACK(size, 0) | GET_PREV_ALLOC(HDRP(bp)) | clean); // Free block header, keeping what the epilogue knew of the block before
   PUT(FTRP(bp), PACK(size, 0));         // Free block footer 
   PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); // New epilogue header 
 
   // Coalesce if the previous block was free 
-  return coalesce(bp);
+  return coalesce(h, bp);
 }
 
-static void printblock(void *bp) {
-  size_t hsize, halloc, fsize, falloc, nextfp, prevfp;
+/*
+ * aligned_payload - Get the first address in free block bp that is skew bytes past a multiple of align,
+ * and leaves either nothing or a valid free block before it
+ */
+static char *aligned_payload(void *bp, size_t align, size_t skew) {
+  char *ap = (char *)((((size_t)bp - skew + align - 1) & ~(align - 1)) + skew);
+
+  // The leading fragment must hold at least a header, the list pointers and a footer
+  if (ap != bp && ap - (char *)bp < 2 * DSIZE)
+    ap += align;
+
+  return ap;
+}
+
+/*
+ * find_aligned_fit - Find a free block that fits a block of asize bytes, whose payload is skew bytes past a multiple of align
+ */
+static void *find_aligned_fit(mm_heap_t *h, size_t asize, size_t align, size_t skew) {
+  int class;
+  char *bp;
+
+  // First-fit search, starting from the first class that could hold the block
+  for (class = get_class(asize); class < NUM_CLASSES && asize <= TREE_MIN; class++) {
+    for (bp = h->seg_listp[class]; bp != NULL; bp = NEXT_FBLK(h, bp)) {
+      if (aligned_payload(bp, align, skew) - bp + asize <= GET_SIZE(HDRP(bp)))
+        return bp;
+    }
+  }
+
+  // Any block in the tree that fits the worst case of alignment padding will do, smaller ones must be checked
+  if ((bp = tree_aligned_fit(h, h->tree_rootp, asize, asize + align + 2 * DSIZE, align, skew)) != NULL)
+    return bp;
+  return tree_best_fit(h, asize + align + 2 * DSIZE);
+}
 
-  checkheap(0, "");
+/*
+ * extend_heap_aligned - Extend the heap just enough for the last block to fit an aligned block of asize bytes
+ */
+static void *extend_heap_aligned(mm_heap_t *h, size_t asize, size_t align, size_t skew) {
+  char *brk = (char *)mem_region_hi(h->region) + 1;
+  char *bp = brk; // The new block starts at the old epilogue
+
+  // If the last block is free, the new block is merged into it
+  if (!GET_PREV_ALLOC(brk - WSIZE))
+    bp = brk - GET_SIZE(brk - DSIZE);
+
+  return extend_heap(h, (aligned_payload(bp, align, skew) + asize - brk) / WSIZE);
+}
+
+/*
+ * place_aligned - Place block of asize bytes at the aligned payload of free block bp.
+ * The leading fragment is split off as its own free block. Returns the placed block
+ */
+static void *place_aligned(mm_heap_t *h, void *bp, size_t asize, size_t align, size_t skew) {
+  char *ap = aligned_payload(bp, align, skew);
+  size_t csize = GET_SIZE(HDRP(bp));
+  size_t lead = ap - (char *)bp;
+  size_t clean = GET(HDRP(bp)) & CLEAN;
+
+  if (lead > 0) {
+    // Shrink bp to the leading fragment. The block before is allocated, so there is nothing to coalesce
+    remove_from_empty_list(h, bp);
+    PUT(HDRP(bp), PACK(lead, 0) | GET_PREV_ALLOC(HDRP(bp)) | clean);
+    PUT(FTRP(bp), PACK(lead, 0));
+    insert_in_empty_list(h, bp);
+    // The rest becomes a free block to place in, after the free fragment
+    PUT(HDRP(ap), PACK(csize - lead, 0) | clean);
+    PUT(FTRP(ap), PACK(csize - lead, 0));
+    insert_in_empty_list(h, ap);
+  }
+  place(h, ap, asize);
+
+  return ap;
+}
+
+/*
+ * is_slab - Check whether p is a slot in a slab
+ */
+static int is_slab(mm_heap_t *h, void *p) {
+  size_t i;
+
+  if ((char *)p < (char *)mem_region_lo(h->region) || (char *)p > (char *)mem_region_hi(h->region))
+    return 0;
+
+  i = SLAB_INDEX(h, p);
+  return (h->slab_map[i / 8] >> (i % 8)) & 1;
+}
+
+/*
+ * slab_alloc - Take a free slot from a slab of the class of size, creating a slab if none has free slots
+ */
+static void *slab_alloc(mm_heap_t *h, size_t size) {
+  int class = SLAB_CLASS(size);
+  char *sp = h->slab_listp[class];
+  unsigned int *bitmap;
+  size_t slot, used, i, bit;
+
+  if (sp == NULL && (sp = slab_create(h, class)) == NULL)
+    return NULL;
+
+  slot = GET(SLAB_SLOTP(sp));
+  used = GET(SLAB_USEDP(sp)) + 1;
+  bitmap = SLAB_BITMAP(sp);
+
+  // Every slab in the list has a free slot, so a word with a clear bit exists
+  for (i = 0; bitmap[i] == ~0u; i++)
+    ;
+  bit = __builtin_ctz(~bitmap[i]);
+  bitmap[i] |= 1u << bit;
+  PUT(SLAB_USEDP(sp), used);
+
+  // A full slab has nothing to give, so take it out of the list
+  if (used == SLAB_SLOTS(slot))
+    unlink_block(h, &h->slab_listp[class], sp);
+
+  return sp + SLAB_HDR + (i * 32 + bit) * slot;
+}
+
+/*
+ * slab_free - Give a slot back to its slab. Frees the slab to the heap when it becomes empty
+ */
+static void slab_free(mm_heap_t *h, void *p) {
+  char *sp = SLAB_BASE(p);
+  size_t slot = GET(SLAB_SLOTP(sp));
+  size_t used = GET(SLAB_USEDP(sp));
+  size_t n = ((char *)p - sp - SLAB_HDR) / slot;
+  size_t i = SLAB_INDEX(h, sp);
+
+  // A full slab isn't in the list, but now has a free slot
+  if (used == SLAB_SLOTS(slot))
+    link_block(h, &h->slab_listp[SLAB_CLASS(slot)], sp);
+
+  SLAB_BITMAP(sp)[n / 32] &= ~(1u << (n % 32));
+  PUT(SLAB_USEDP(sp), --used);
+
+  if (used == 0) {
+    // Forget the slab before freeing it, so mm_heap_free treats it as a normal block
+    unlink_block(h, &h->slab_listp[SLAB_CLASS(slot)], sp);
+    h->slab_map[i / 8] &= ~(1 << (i % 8));
+    mm_heap_free(h, sp);
+  }
+}
+
+/*
+ * slab_create - Allocate and initialize an empty slab for the given slab class, and add it to the list
+ */
+static void *slab_create(mm_heap_t *h, int class) {
+  size_t asize = SLAB_SIZE;
+  size_t slot = (class + 1) * DSIZE;
+  size_t nslots = SLAB_SLOTS(slot);
+  unsigned int *bitmap;
+  size_t i;
+  char *bp;
+
+  if ((bp = find_aligned_fit(h, asize, SLAB_SIZE, DSIZE)) == NULL &&
+      (bp = extend_heap_aligned(h, asize, SLAB_SIZE, DSIZE)) == NULL)
+    return NULL;
+  bp = place_aligned(h, bp, asize, SLAB_SIZE, DSIZE);
+
+  PUT(SLAB_SLOTP(bp), slot);
+  PUT(SLAB_USEDP(bp), 0);
+  // Mark the bits past the last slot as used, so they're never handed out
+  bitmap = SLAB_BITMAP(bp);
+  for (i = 0; i < SLAB_MAP_WORDS; i++)
+    bitmap[i] = 0;
+  for (i = nslots; i < SLAB_MAP_WORDS * 32; i++)
+    bitmap[i / 32] |= 1u << (i % 32);
+
+  i = SLAB_INDEX(h, bp);
+  h->slab_map[i / 8] |= 1 << (i % 8);
+  h->slab_map_top = MAX(h->slab_map_top, i / 8 + 1);
+  link_block(h, &h->slab_listp[class], bp);
+
+  return bp;
+}
+
+/*
+ * is_huge - Check whether block bp of heap h is a huge block, which is outside the region of the heap
+ */
+static int is_huge(mm_heap_t *h, void *bp) {
+  return (char *)bp < (char *)mem_region_lo(h->region) || (char *)bp > (char *)mem_region_hi(h->region);
+}
+
+/*
+ * huge_alloc - Allocate a huge block with at least size bytes of payload in a mapping of its own
+ */
+static void *huge_alloc(mm_heap_t *h, size_t size) {
+  return huge_memalign(h, DSIZE, size);
+}
+
+/*
+ * huge_memalign - Allocate a huge block with at least size bytes of payload starting at a multiple of align, which
+ * is a power of two no larger than a page. The payload is put at align into the page aligned mapping, or HUGE_HDR
+ * if that's larger, and its huge_t right before it, so the mapping starts in the page the huge_t is in
+ */
+static void *huge_memalign(mm_heap_t *h, size_t align, size_t size) {
+  size_t offset = MAX(align, HUGE_HDR);
+  size_t msize = (size + offset + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+  char *mp, *bp;
+  huge_t *hp;
+
+  // The size of the mapping must fit in a word
+  if (msize > MAX_BLOCK || (mp = mem_map(msize)) == NULL)
+    return NULL;
+  hp = HUGE_BLK(mp + offset);
+
+  hp->heap = h;
+  hp->prev = NULL;
+  if ((hp->next = h->huge_listp) != NULL)
+    hp->next->prev = hp;
+  h->huge_listp = hp;
+
+  bp = HUGE_PAYLOAD(hp);
+  PUT(HUGE_SIZEP(bp), msize);
+  PUT(HDRP(bp), PACK(0, 1));
+
+  return bp;
+}
+
+/*
+ * huge_free - Unmap huge block bp of heap h
+ */
+static void huge_free(mm_heap_t *h, void *bp) {
+  huge_t *hp = HUGE_BLK(bp);
+
+  if (hp->prev != NULL)
+    hp->prev->next = hp->next;
+  else
+    h->huge_listp = hp->next;
+  if (hp->next != NULL)
+    hp->next->prev = hp->prev;
+
+  mem_unmap(HUGE_MAP(bp));
+}
+
+/*
+ * huge_realloc - Resize huge block bp of heap h to size bytes of payload. The mapping is resized, moving its pages
+ * if it can't grow where it is, so the payload is never copied. It stays huge even if it shrinks
+ */
+static void *huge_realloc(mm_heap_t *h, void *bp, size_t size) {
+  size_t offset = (char *)bp - (char *)HUGE_MAP(bp); // Kept, along with the alignment, by the new mapping
+  size_t msize = (size + offset + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+  char *mp;
+  huge_t *hp;
+
+  if (msize > MAX_BLOCK || (mp = mem_remap(HUGE_MAP(bp), msize)) == NULL)
+    return NULL;
+  hp = HUGE_BLK(mp + offset);
+
+  // The neighbours in the list point to where the block was
+  if (hp->prev != NULL)
+    hp->prev->next = hp;
+  else
+    h->huge_listp = hp;
+  if (hp->next != NULL)
+    hp->next->prev = hp;
+
+  bp = HUGE_PAYLOAD(hp);
+  PUT(HUGE_SIZEP(bp), msize);
+
+  return bp;
+}
+
+/*
+ * huge_expand - Grow huge block bp to at least size bytes of payload without moving it. Returns -1 if it can't
+ */
+static int huge_expand(mm_heap_t *h, void *bp, size_t size) {
+  size_t msize = (size + ((char *)bp - (char *)HUGE_MAP(bp)) + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+
+  if (msize > MAX_BLOCK || mem_extend(HUGE_MAP(bp), msize) == -1)
+    return -1;
+  PUT(HUGE_SIZEP(bp), MAX(msize, GET(HUGE_SIZEP(bp))));
+
+  return 0;
+}
+
+static void printblock(mm_heap_t *h, void *bp) {
+  size_t hsize, halloc, hprev, fsize, falloc;
+  void *nextfp, *prevfp;
+
+  checkheap(h, 0, "");
   hsize = GET_SIZE(HDRP(bp));
   halloc = GET_ALLOC(HDRP(bp));
-  fsize = GET_SIZE(FTRP(bp));
-  falloc = GET_ALLOC(FTRP(bp));
-  nextfp = GET(NEXT_FBLKP(bp));
-  prevfp = GET(PREV_FBLKP(bp));
+  hprev = GET_PREV_ALLOC(HDRP(bp));
 
   if (hsize == 0) {
     printf("%p: EOL\n", bp);
     return;
   }
 
-  printf("%p: header: [%ld:%c] footer: [%ld:%c].", bp, hsize,
-         (halloc ? 'a' : 'f'), fsize, (falloc ? 'a' : 'f'));
-  if (!halloc) printf(" list: [%p:%p]\n", nextfp, prevfp);
+  printf("%p: header: [%zu:%c:%c]", bp, hsize, (hprev ? 'a' : 'f'), (halloc ? 'a' : 'f'));
+  // Only free blocks have a footer and list pointers
+  if (!halloc) {
+    fsize = GET_SIZE(FTRP(bp));
+    falloc = GET_ALLOC(FTRP(bp));
+    nextfp = NEXT_FBLK(h, bp);
+    prevfp = PREV_FBLK(h, bp);
+    printf(" footer: [%zu:%c]. list: [%p:%p]\n", fsize, (falloc ? 'a' : 'f'), nextfp, prevfp);
+  }
   else printf("\n");
 }
 
 /*
  * mm_checkheap - Check the heap for correctness
  */
-void mm_checkheap(int verbose) { checkheap(verbose, ""); }
+void mm_checkheap(int verbose) { checkheap(&default_heap, verbose, ""); }
 
-static void checkblock(void *bp) {
+static void checkblock(mm_heap_t *h, void *bp) {
   // The pointer must be doubleword aligned
   if ((size_t)bp % DSIZE)
     printf("Error: %p is not doubleword aligned\n", bp);
-  // Header and footer location must be correct and contain the same data
-  if (GET(HDRP(bp)) != GET(FTRP(bp)))
+  // Header and footer location must be correct and contain the same size. Allocated blocks have no footer
+  if (!GET_ALLOC(HDRP(bp)) && GET_SIZE(HDRP(bp)) != GET_SIZE(FTRP(bp)))
     printf("Error: header does not match footer\n");
+  // A slab must be consistent with its bitmap
+  if (bp == SLAB_BASE(bp) && is_slab(h, bp))
+    checkslab(bp);
+}
+
+/*
+ * checkslab - Check that the used count of a slab matches its bitmap
+ */
+static void checkslab(void *sp) {
+  size_t used = 0, i;
+  size_t nslots = SLAB_SLOTS(GET(SLAB_SLOTP(sp)));
+
+  if (!GET_ALLOC(HDRP(sp)) || GET_SIZE(HDRP(sp)) < SLAB_SIZE)
+    printf("Error: slab %p is not an allocated block of a page\n", sp);
+  for (i = 0; i < nslots; i++)
+    used += (SLAB_BITMAP(sp)[i / 32] >> (i % 32)) & 1;
+  if (used != GET(SLAB_USEDP(sp)))
+    printf("Error: slab %p has %u used slots, but %u bits set\n", sp, GET(SLAB_USEDP(sp)), (unsigned int)used);
 }
 
 /*
  * checkheap - Minimal check of the heap for consistency
  */
-void checkheap(int verbose, char name[]) {
-  char *bp = heap_listp;
+void checkheap(mm_heap_t *h, int verbose, char name[]) {
+  char *bp = h->heap_listp;
+  huge_t *hp;
+  size_t prev_alloc, dirty_size = 0, listed_size = 0;
+  char *dp;
+  int i;
 
   if (verbose) {
     printf("Checking heap for %s\n", name);
     // Print the location of the heap
-    printf("Heap (%p):\n", heap_listp);
+    printf("Heap (%p):\n", h->heap_listp);
   }
 
   // Prologue header must be 2 words, and not allocated.
-  if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp)))
+  if ((GET_SIZE(HDRP(h->heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(h->heap_listp)))
     printf("Bad prologue header\n");
   // Check the prologue header
-  checkblock(heap_listp);
+  checkblock(h, h->heap_listp);
 
   // Init bp to the end of the prologue header
   // Loop if the size of the header is above 0
@@ -453,40 +2696,111 @@ void checkheap(int verbose, char name[]) {
   // NOTE: This loop is bad. The epilogue header hasn't been checked yet and could be incorrect
   // NOTE: If something has it's size set to 0 the loop would also end, not actually checking the entire heap.
   // TODO: One could store the heap info in the prologue header to check the correctness of the prologue and epilogue headers
-  for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+  for (bp = NEXT_BLKP(h->heap_listp), prev_alloc = 1; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
     if (verbose)
-      printblock(bp);
+      printblock(h, bp);
     // Check every single block
-    checkblock(bp);
+    checkblock(h, bp);
+    // The block must know the state of the block before it, and never follow a free block when free
+    if (!GET_PREV_ALLOC(HDRP(bp)) != !prev_alloc)
+      printf("Error: %p has a wrong prev alloc bit\n", bp);
+    if (!prev_alloc && !GET_ALLOC(HDRP(bp)))
+      printf("Error: %p and the block before it are both free\n", bp);
+    prev_alloc = GET_ALLOC(HDRP(bp));
+    if (!prev_alloc && GET_SIZE(HDRP(bp)) > TREE_MIN && GET(DIRTY_NEXTP(bp)) != DIRTY_NONE) {
+      if (GET(HDRP(bp)) & CLEAN)
+        printf("Error: %p is CLEAN, but in the dirty list\n", bp);
+      dirty_size += GET_SIZE(HDRP(bp));
+    }
   }
+  for (dp = h->dirty_headp; dp != NULL; dp = FROM_OFFSET(h, GET(DIRTY_NEXTP(dp))))
+    listed_size += GET_SIZE(HDRP(dp));
+  if (dirty_size != h->dirty_size || listed_size != h->dirty_size)
+    printf("Error: %zu bytes of blocks marked dirty and %zu in the dirty list, but %zu counted\n",
+           dirty_size, listed_size, h->dirty_size);
 
   if (verbose)
-    printblock(bp);
+    printblock(h, bp);
   // Size of epilogue must be 0
   // Epilogue must not allocated
   // NOTE: See note at loop, this could cause issues
-  if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
+  if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))) || !GET_PREV_ALLOC(HDRP(bp)) != !prev_alloc)
     printf("Bad epilogue header\n");
 
+  // Every block in the free lists must be free and belong to the class of the list
+  for (i = 0; i < NUM_CLASSES; i++) {
+    if (verbose)
+      printf("seg_list[%d]: %p\n", i, h->seg_listp[i]);
+    for (bp = h->seg_listp[i]; bp != NULL; bp = NEXT_FBLK(h, bp)) {
+      if (GET_ALLOC(HDRP(bp)))
+        printf("Error: %p is in free list %d but allocated\n", bp, i);
+      if (get_class(GET_SIZE(HDRP(bp))) != i)
+        printf("Error: %p is in free list %d but has size %u\n", bp, i, GET_SIZE(HDRP(bp)));
+    }
+  }
+
   if (verbose)
-    printf("first_free: %p\n", first_freep);
-  if (verbose && first_freep != NULL) {
-    printf("Free list root:\n"); 
-    printblock(first_freep);
+    printf("tree: %p\n", h->tree_rootp);
+  checktree(h, h->tree_rootp, NULL, NULL);
+
+  // Every huge block must belong to the heap, and be tagged as one
+  for (hp = h->huge_listp; hp != NULL; hp = hp->next) {
+    if (verbose)
+      printf("huge: %p, size %u\n", HUGE_PAYLOAD(hp), GET(HUGE_SIZEP(HUGE_PAYLOAD(hp))));
+    if (hp->heap != h || GET(HDRP(HUGE_PAYLOAD(hp))) != PACK(0, 1))
+      printf("Error: huge block %p is bad\n", HUGE_PAYLOAD(hp));
+    if (hp->next != NULL && hp->next->prev != hp)
+      printf("Error: huge block %p is badly linked\n", HUGE_PAYLOAD(hp));
   }
 }
 
+/*
+ * checktree - Check that every block in the subtree bp is free, large and between the blocks lo and hi in order
+ * Returns the number of blocks in the subtree
+ */
+static size_t checktree(mm_heap_t *h, void *bp, void *lo, void *hi) {
+  if (bp == NULL)
+    return 0;
+
+  if (GET_ALLOC(HDRP(bp)))
+    printf("Error: %p is in the tree but allocated\n", bp);
+  if (GET_SIZE(HDRP(bp)) <= TREE_MIN)
+    printf("Error: %p is in the tree but has size %u\n", bp, GET_SIZE(HDRP(bp)));
+  if ((lo != NULL && tree_cmp(GET_SIZE(HDRP(lo)), lo, bp) >= 0) ||
+      (hi != NULL && tree_cmp(GET_SIZE(HDRP(hi)), hi, bp) <= 0))
+    printf("Error: %p is out of order in the tree\n", bp);
+
+  return 1 + checktree(h, TREE_LEFT(h, bp), lo, bp) + checktree(h, TREE_RIGHT(h, bp), bp, hi);
+}
+
 static size_t get_alligned(size_t size) {
-  // Adjust allocation size to be doubleword alligned
-  if (size <= DSIZE)
+  // Adjust allocation size to be doubleword alligned, with room for the header.
+  // The block must still be able to hold the list pointers and footer once freed
+  if (size <= DSIZE + WSIZE)
     return 2 * DSIZE;
   else
     // Abuse integer division to adjust
-    // mm_malloc 10
-    // 8 * ((10 + 8 + (8 - 1)) / 8)
-    // 8 * ((10 + 8 + 7) / 8)
-    // 8 * (25 / 8)
-    // 8 * 4
-    // 32
-    return DSIZE * ((size + (DSIZE) + (DSIZE - 1)) / DSIZE);
+    // mm_malloc 20
+    // 8 * ((20 + 4 + (8 - 1)) / 8)
+    // 8 * ((20 + 4 + 7) / 8)
+    // 8 * (31 / 8)
+    // 8 * 3
+    // 24
+    return DSIZE * ((size + (WSIZE) + (DSIZE - 1)) / DSIZE);
+}
+
+/*
+ * get_class - Get the index of the size class, and thereby free list, a block of size bytes belongs to
+ */
+static int get_class(size_t size) {
+  int class = 0;
+  size_t limit = MIN_CLASS;
+
+  // Double the upper bound until the size fits, the last class takes the rest
+  while (class < NUM_CLASSES - 1 && size > limit) {
+    limit <<= 1;
+    class++;
+  }
+
+  return class;
 }
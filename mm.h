@@ -4,6 +4,47 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+extern void mm_free_batch(void **ptrs, size_t n);
+extern size_t mm_usable_size(void *ptr);
+extern size_t mm_expand(void *ptr, size_t min, size_t max);
+extern int mm_trim(size_t pad);
+extern size_t mm_purge(void);
+
+/* 
+ * Heaps of their own, independent of the one behind mm_malloc.
+ * A block must be freed and reallocated in the heap it came from.
+ */
+typedef struct mm_heap mm_heap_t;
+
+extern mm_heap_t *mm_heap_create(void);
+extern void mm_heap_destroy(mm_heap_t *heap);
+extern void *mm_heap_malloc(mm_heap_t *heap, size_t size);
+extern void mm_heap_free(mm_heap_t *heap, void *ptr);
+extern void *mm_heap_realloc(mm_heap_t *heap, void *ptr, size_t size);
+extern void *mm_heap_memalign(mm_heap_t *heap, size_t align, size_t size);
+extern void *mm_heap_calloc(mm_heap_t *heap, size_t nmemb, size_t size);
+extern size_t mm_heap_malloc_batch(mm_heap_t *heap, size_t size, size_t n, void **ptrs);
+extern void mm_heap_free_batch(mm_heap_t *heap, void **ptrs, size_t n);
+extern size_t mm_heap_usable_size(mm_heap_t *heap, void *ptr);
+extern size_t mm_heap_expand(mm_heap_t *heap, void *ptr, size_t min, size_t max);
+extern int mm_heap_trim(mm_heap_t *heap, size_t pad);
+extern size_t mm_heap_purge(mm_heap_t *heap);
+
+/*
+ * Arenas of scratch memory, handed out by bumping a pointer through chunks of the
+ * heap behind mm_malloc, and freed all at once. An arena is used by one thread at a time.
+ */
+typedef struct mm_arena mm_arena_t;
+
+extern mm_arena_t *mm_arena_create(size_t chunk);
+extern void mm_arena_destroy(mm_arena_t *arena);
+extern void *mm_arena_alloc(mm_arena_t *arena, size_t size);
+extern void *mm_arena_mark(mm_arena_t *arena);
+extern void mm_arena_release(mm_arena_t *arena, void *mark);
+extern void mm_arena_reset(mm_arena_t *arena);
 
 
 /* 